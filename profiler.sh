@@ -7,8 +7,10 @@ usage() {
     echo "  start             start profiling and return immediately"
     echo "  resume            resume profiling without resetting collected data"
     echo "  stop              stop profiling"
+    echo "  snapshot          dump collected profile and continue with empty one"
     echo "  check             check if the specified profiling event is available"
     echo "  status            print profiling status"
+    echo "  meminfo           print memory used by the profiler itself"
     echo "  list              list profiling events supported by the target JVM"
     echo "  collect           collect profile for the specified period of time"
     echo "                    and then stop (default action)"
@@ -35,7 +37,17 @@ usage() {
     echo "  --lock duration   lock profiling threshold in nanoseconds"
     echo "  --total           accumulate the total value (time, bytes, etc.)"
     echo "  --all-user        only include user-mode events"
-    echo "  --cstack mode     how to traverse C stack: fp|lbr|no"
+    echo "  --cstack mode     how to traverse C stack: fp|dwarf|lbr|no"
+    echo "  --nativeonly      sample native stacks without signals (perf events)"
+    echo "  --percpu          one perf event per CPU instead of per thread"
+    echo "  --pmugroup        read IPC, cache and branch misses with each sample"
+    echo "  --dataaddr        show memory regions of sampled data addresses"
+    echo "  --sharded         count samples in per-thread shards (many-core machines)"
+    echo "  --memlimit bytes  limit memory used for storing call traces"
+    echo "  --trie            share common stack prefixes (saves memory on deep stacks only)"
+    echo "  --hugepages       use huge pages for call trace storage"
+    echo "  --lazysymbols     load library symbols on first sample"
+    echo "  --symcache dir    reuse library symbol indexes in dir"
     echo "  --begin function  begin profiling when function is executed"
     echo "  --end function    end profiling when function is executed"
     echo "  --ttsp            time-to-safepoint profiling"
@@ -126,7 +138,7 @@ while [ $# -gt 0 ]; do
         -h|"-?")
             usage
             ;;
-        start|resume|stop|check|status|list|collect)
+        start|resume|stop|snapshot|check|status|meminfo|list|collect)
             ACTION="$1"
             ;;
         -v|--version)
@@ -198,7 +210,7 @@ while [ $# -gt 0 ]; do
         --samples|--total)
             FORMAT="$FORMAT,${1#--}"
             ;;
-        --alloc|--lock)
+        --alloc|--lock|--memlimit)
             PARAMS="$PARAMS,${1#--}=$2"
             shift
             ;;
@@ -209,7 +221,10 @@ while [ $# -gt 0 ]; do
             PARAMS="$PARAMS,cstack=$2"
             shift
             ;;
-        --begin|--end)
+        --sharded|--trie|--hugepages|--lazysymbols|--nativeonly|--percpu|--pmugroup|--dataaddr)
+            PARAMS="$PARAMS,${1#--}"
+            ;;
+        --begin|--end|--symcache)
             PARAMS="$PARAMS,${1#--}=$2"
             shift
             ;;
@@ -283,11 +298,11 @@ case $ACTION in
     start|resume|check)
         jattach "$ACTION,file=$FILE,$OUTPUT$FORMAT$PARAMS"
         ;;
-    stop)
-        jattach "stop,file=$FILE,$OUTPUT$FORMAT"
+    stop|snapshot)
+        jattach "$ACTION,file=$FILE,$OUTPUT$FORMAT"
         ;;
-    status)
-        jattach "status,file=$FILE"
+    status|meminfo)
+        jattach "$ACTION,file=$FILE"
         ;;
     list)
         jattach "list,file=$FILE"
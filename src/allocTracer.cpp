@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <string.h>
 #include "allocTracer.h"
 #include "profiler.h"
 #include "stackFrame.h"
@@ -26,6 +27,13 @@ Trap AllocTracer::_outside_tlab(1);
 
 u64 AllocTracer::_interval;
 volatile u64 AllocTracer::_allocated_bytes;
+volatile u64 AllocTracer::_class_cache[CLASS_CACHE_SIZE];
+
+
+static inline u64 classCacheHash(VMKlass* klass, VMSymbol* name) {
+    u64 h = ((u64)(uintptr_t)klass * 0x9e3779b97f4a7c15ULL) ^ (u64)(uintptr_t)name;
+    return h * 0xff51afd7ed558ccdULL;
+}
 
 
 // Called whenever our breakpoint trap is hit
@@ -88,13 +96,36 @@ void AllocTracer::recordAllocation(void* ucontext, int event_type, uintptr_t rkl
     event._instance_size = instance_size;
 
     if (VMStructs::hasClassNames()) {
-        VMSymbol* symbol = VMKlass::fromHandle(rklass)->name();
-        event._class_id = Profiler::instance()->classMap()->lookup(symbol->body(), symbol->length());
+        event._class_id = lookupClass(rklass);
     }
 
     Profiler::instance()->recordSample(ucontext, total_size, event_type, &event);
 }
 
+// Resolving a class name through the dictionary means hashing the whole name,
+// while the same few classes are allocated over and over again.
+// Each cache entry is a single word: class ID in the upper half and a check tag in the lower.
+// The tag depends on the Klass address, its name Symbol and the ID itself, so neither
+// a reused Klass address after class unloading nor a torn 64-bit write yields a wrong ID.
+u32 AllocTracer::lookupClass(uintptr_t rklass) {
+    VMKlass* klass = VMKlass::fromHandle(rklass);
+    VMSymbol* symbol = klass->name();
+    u64 h = classCacheHash(klass, symbol);
+    volatile u64* entry = &_class_cache[h >> (64 - CLASS_CACHE_BITS)];
+
+    u64 cached = *entry;
+    u32 class_id = (u32)(cached >> 32);
+    if (class_id != 0 && (u32)cached == ((u32)h ^ class_id)) {
+        return class_id;
+    }
+
+    class_id = Profiler::instance()->classMap()->lookup(symbol->body(), symbol->length());
+    if (class_id != 0) {
+        *entry = (u64)class_id << 32 | ((u32)h ^ class_id);
+    }
+    return class_id;
+}
+
 Error AllocTracer::check(Arguments& args) {
     if (_in_new_tlab.entry() != 0 && _outside_tlab.entry() != 0) {
         return Error::OK;
@@ -133,6 +164,9 @@ Error AllocTracer::start(Arguments& args) {
     _interval = args._alloc;
     _allocated_bytes = 0;
 
+    // Class IDs are no longer valid if the class map has been reset
+    memset((void*)_class_cache, 0, sizeof(_class_cache));
+
     if (!_in_new_tlab.install() || !_outside_tlab.install()) {
         return Error("Cannot install allocation breakpoints");
     }
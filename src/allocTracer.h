@@ -23,6 +23,10 @@
 #include "trap.h"
 
 
+const int CLASS_CACHE_BITS = 10;
+const u32 CLASS_CACHE_SIZE = 1 << CLASS_CACHE_BITS;
+
+
 class AllocTracer : public Engine {
   private:
     static int _trap_kind;
@@ -32,6 +36,11 @@ class AllocTracer : public Engine {
     static u64 _interval;
     static volatile u64 _allocated_bytes;
 
+    // Direct-mapped Klass* -> class ID cache; see lookupClass()
+    static volatile u64 _class_cache[CLASS_CACHE_SIZE];
+
+    static u32 lookupClass(uintptr_t rklass);
+
     static void recordAllocation(void* ucontext, int event_type, uintptr_t rklass,
                                  uintptr_t total_size, uintptr_t instance_size);
 
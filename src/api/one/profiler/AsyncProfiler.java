@@ -112,6 +112,20 @@ public class AsyncProfiler implements AsyncProfilerMXBean {
         }
     }
 
+    /**
+     * Get native memory used by the profiler itself, per subsystem
+     *
+     * @return Textual report of memory usage
+     */
+    @Override
+    public String getMemoryUsage() {
+        try {
+            return execute0("meminfo");
+        } catch (IOException e) {
+            throw new IllegalStateException(e);
+        }
+    }
+
     /**
      * Execute an agent-compatible profiling command -
      * the comma-separated list of arguments described in arguments.cpp
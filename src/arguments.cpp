@@ -48,8 +48,10 @@ const size_t EXTRA_BUF_SIZE = 512;
 //     start           - start profiling
 //     resume          - start or resume profiling without resetting collected data
 //     stop            - stop profiling
+//     snapshot        - dump the profile collected so far and continue with empty storage
 //     check           - check if the specified profiling event is available
 //     status          - print profiling status (inactive / running for X seconds)
+//     meminfo         - print memory used by the profiler itself, per subsystem
 //     list            - show the list of available profiling events
 //     version[=full]  - display the agent version
 //     event=EVENT     - which event to trace (cpu, wall, cache-misses, etc.)
@@ -70,8 +72,19 @@ const size_t EXTRA_BUF_SIZE = 512;
 //     log=FILENAME    - log warnings and errors to the given dedicated stream
 //     filter=FILTER   - thread filter
 //     threads         - profile different threads separately
+//     sharded         - count samples in per-lock shards to reduce contention on hot stacks
+//     memlimit=BYTES  - limit memory for storing call traces; new traces are evicted when exceeded
+//     trie            - store call traces in a prefix tree; saves memory only if stacks share long prefixes
+//     hugepages       - back call trace storage with huge pages, if available
+//     lazysymbols     - load symbols of a native library when it first appears in a sample
+//     symcache=DIR    - reuse symbol indexes of native libraries stored in the given directory
 //     cstack=MODE     - how to collect C stack frames in addition to Java stack
-//                       MODE is 'fp' (Frame Pointer), 'lbr' (Last Branch Record) or 'no'
+//                       MODE is 'fp' (Frame Pointer), 'dwarf' (DWARF unwind info),
+//                       'lbr' (Last Branch Record) or 'no'
+//     nativeonly      - collect perf_events samples without signals; Java frames are not resolved
+//     percpu          - open one perf_event per CPU for the process cgroup; implies nativeonly
+//     pmugroup        - read cycles, instructions, cache and branch misses with every perf_events sample
+//     dataaddr        - add the memory region of the sampled data address as the top frame
 //     allkernel       - include only kernel-mode events
 //     alluser         - include only user-mode events
 //     simple          - simple class names instead of FQN
@@ -118,12 +131,18 @@ Error Arguments::parse(const char* args) {
             CASE("stop")
                 _action = ACTION_STOP;
 
+            CASE("snapshot")
+                _action = ACTION_SNAPSHOT;
+
             CASE("check")
                 _action = ACTION_CHECK;
 
             CASE("status")
                 _action = ACTION_STATUS;
 
+            CASE("meminfo")
+                _action = ACTION_MEMINFO;
+
             CASE("list")
                 _action = ACTION_LIST;
 
@@ -221,6 +240,38 @@ Error Arguments::parse(const char* args) {
             CASE("threads")
                 _threads = true;
 
+            CASE("sharded")
+                _sharded = true;
+
+            CASE("trie")
+                _trie = true;
+
+            CASE("hugepages")
+                _hugepages = true;
+
+            CASE("lazysymbols")
+                _lazy_symbols = true;
+
+            CASE("nativeonly")
+                _native_only = true;
+
+            CASE("percpu")
+                _per_cpu = true;
+
+            CASE("pmugroup")
+                _pmu_group = true;
+
+            CASE("dataaddr")
+                _data_addr = true;
+
+            CASE("symcache")
+                _symcache = value == NULL || value[0] == 0 ? NULL : value;
+
+            CASE("memlimit")
+                if (value == NULL || (_memlimit = parseUnits(value)) < 0) {
+                    msg = "Invalid memlimit";
+                }
+
             CASE("allkernel")
                 _ring = RING_KERNEL;
 
@@ -233,6 +284,8 @@ Error Arguments::parse(const char* args) {
                         _cstack = CSTACK_NO;
                     } else if (value[0] == 'l') {
                         _cstack = CSTACK_LBR;
+                    } else if (value[0] == 'd') {
+                        _cstack = CSTACK_DWARF;
                     } else {
                         _cstack = CSTACK_FP;
                     }
@@ -291,6 +344,13 @@ Error Arguments::parse(const char* args) {
         _dump_flat = 200;
     }
 
+    if (_action == ACTION_SNAPSHOT && _output == OUTPUT_NONE) {
+        // Snapshot discards the dumped generation, so there must be some output
+        _output = OUTPUT_TEXT;
+        _dump_traces = 100;
+        _dump_flat = 200;
+    }
+
     if (_output != OUTPUT_NONE && (_action == ACTION_NONE || _action == ACTION_STOP)) {
         _action = ACTION_DUMP;
     }
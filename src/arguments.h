@@ -28,6 +28,7 @@ const char* const EVENT_ALLOC  = "alloc";
 const char* const EVENT_LOCK   = "lock";
 const char* const EVENT_WALL   = "wall";
 const char* const EVENT_ITIMER = "itimer";
+const char* const EVENT_CTIMER = "ctimer";
 
 enum Action {
     ACTION_NONE,
@@ -36,10 +37,12 @@ enum Action {
     ACTION_STOP,
     ACTION_CHECK,
     ACTION_STATUS,
+    ACTION_MEMINFO,
     ACTION_LIST,
     ACTION_VERSION,
     ACTION_FULL_VERSION,
-    ACTION_DUMP
+    ACTION_DUMP,
+    ACTION_SNAPSHOT
 };
 
 enum Counter {
@@ -64,7 +67,8 @@ enum CStack {
     CSTACK_DEFAULT,
     CSTACK_NO,
     CSTACK_FP,
-    CSTACK_LBR
+    CSTACK_LBR,
+    CSTACK_DWARF
 };
 
 enum Output {
@@ -81,11 +85,12 @@ enum JfrOption {
     NO_SYSTEM_INFO  = 0x1,
     NO_SYSTEM_PROPS = 0x2,
     NO_CPU_LOAD     = 0x4,
+    NO_MEMORY_USAGE = 0x8,
 
     JFR_SYNC        = 0x10,
     JFR_TEMP_FILE   = 0x20,
 
-    JFR_COMBINE     = NO_SYSTEM_INFO | NO_SYSTEM_PROPS | NO_CPU_LOAD | JFR_SYNC | JFR_TEMP_FILE
+    JFR_COMBINE     = NO_SYSTEM_INFO | NO_SYSTEM_PROPS | NO_CPU_LOAD | NO_MEMORY_USAGE | JFR_SYNC | JFR_TEMP_FILE
 };
 
 
@@ -129,6 +134,7 @@ class Arguments {
     long _interval;
     long _alloc;
     long _lock;
+    long _memlimit;
     int  _jstackdepth;
     int _safe_mode;
     const char* _file;
@@ -137,8 +143,17 @@ class Arguments {
     int _include;
     int _exclude;
     bool _threads;
+    bool _sharded;
+    bool _trie;
+    bool _hugepages;
+    bool _lazy_symbols;
+    const char* _symcache;
     int _style;
     CStack _cstack;
+    bool _native_only;
+    bool _per_cpu;
+    bool _pmu_group;
+    bool _data_addr;
     Output _output;
     int _jfr_options;
     int _dump_traces;
@@ -160,6 +175,7 @@ class Arguments {
         _interval(0),
         _alloc(0),
         _lock(0),
+        _memlimit(0),
         _jstackdepth(DEFAULT_JSTACKDEPTH),
         _safe_mode(0),
         _file(NULL),
@@ -168,8 +184,17 @@ class Arguments {
         _include(0),
         _exclude(0),
         _threads(false),
+        _sharded(false),
+        _trie(false),
+        _hugepages(false),
+        _lazy_symbols(false),
+        _symcache(NULL),
         _style(0),
         _cstack(CSTACK_DEFAULT),
+        _native_only(false),
+        _per_cpu(false),
+        _pmu_group(false),
+        _data_addr(false),
         _output(OUTPUT_NONE),
         _jfr_options(0),
         _dump_traces(0),
@@ -14,44 +14,97 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "callTraceStorage.h"
+#include "memoryUsage.h"
 #include "os.h"
 
 
 static const u32 INITIAL_CAPACITY = 65536;
 static const u32 CALL_TRACE_CHUNK = 8 * 1024 * 1024;
 static const u32 OVERFLOW_TRACE_ID = 0x7fffffff;
+static const int MAX_PUBLISH_SPINS = 10000;
+static const int COMPACT_TRACE = -1;
+static const int MAX_TRIE_SIBLINGS = 256;
+
+
+// Private per-shard copy of CallTraceSample counters
+struct ShardCounter {
+    u64 samples;
+    u64 counter;
+};
+
+
+// Node of the prefix tree of call traces stored in 'trie' mode. Each node holds a run of frames
+// that continues the first 'attach' frames of its parent run; frames go from the root side
+// (the last frame of a call trace) towards the top. A trace that diverges from the known ones
+// adds only its unshared frames as one node. Nodes never change once linked into the tree.
+struct TraceNode {
+    TraceNode* parent;
+    TraceNode* volatile children;  // runs attached to this one at any position
+    TraceNode* next;
+    u32 attach;
+    u32 length;
+    ASGCT_CallFrame frames[1];
+};
+
+// Compact call trace refers to the tree node holding its top frame,
+// and how many frames of that node the trace includes.
+// Header is the same as CallTrace, which is recognized by COMPACT_TRACE marker.
+struct CompactTrace {
+    int num_frames;
+    u32 id;
+    int depth;
+    u32 leaf_length;
+    TraceNode* leaf;
+};
 
 
 class LongHashTable {
   private:
     LongHashTable* _prev;
-    void* _padding0;
+    u8 _use_huge_pages;
+    u8 _huge_pages;
+    u8 _padding0[6];
     u32 _capacity;
-    u32 _padding1[15];
+    u32 _shards;
+    u32 _groups;
+    u32 _padding1[13];
     volatile u32 _size;
     u32 _padding2[15];
 
-    static size_t getSize(u32 capacity) {
-        size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample)) * capacity;
+  public:
+    static size_t getSize(u32 capacity, u32 shards, u32 groups) {
+        size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample)) * capacity
+                    + sizeof(ShardCounter) * capacity * shards + sizeof(u64) * capacity * groups;
         return (size + OS::page_mask) & ~OS::page_mask;
     }
 
-  public:
-    static LongHashTable* allocate(LongHashTable* prev, u32 capacity) {
-        LongHashTable* table = (LongHashTable*)OS::safeAlloc(getSize(capacity));
+    static LongHashTable* allocate(LongHashTable* prev, u32 capacity, u32 shards, u32 groups, bool use_huge_pages) {
+        HugePages huge_pages = HUGE_PAGES_NONE;
+        size_t size = getSize(capacity, shards, groups);
+        LongHashTable* table = use_huge_pages
+            ? (LongHashTable*)OS::safeAllocHuge(size, &huge_pages)
+            : (LongHashTable*)OS::safeAlloc(size);
         if (table != NULL) {
             table->_prev = prev;
+            table->_use_huge_pages = use_huge_pages;
+            table->_huge_pages = huge_pages;
             table->_capacity = capacity;
+            table->_shards = shards;
+            table->_groups = groups;
             table->_size = 0;
+            MemoryUsage::allocate(MEM_TRACE_TABLES, size);
         }
         return table;
     }
 
     LongHashTable* destroy() {
         LongHashTable* prev = _prev;
-        OS::safeFree(this, getSize(_capacity));
+        MemoryUsage::release(MEM_TRACE_TABLES, bytes());
+        OS::safeFree(this, bytes());
         return prev;
     }
 
@@ -59,10 +112,34 @@ class LongHashTable {
         return _prev;
     }
 
+    void unlinkPrev() {
+        _prev = NULL;
+    }
+
+    size_t bytes() {
+        return getSize(_capacity, _shards, _groups);
+    }
+
     u32 capacity() {
         return _capacity;
     }
 
+    u32 shards() {
+        return _shards;
+    }
+
+    u32 groups() {
+        return _groups;
+    }
+
+    bool useHugePages() {
+        return _use_huge_pages;
+    }
+
+    HugePages hugePages() {
+        return (HugePages)_huge_pages;
+    }
+
     u32 size() {
         return _size;
     }
@@ -79,33 +156,150 @@ class LongHashTable {
         return (CallTraceSample*)(keys() + _capacity);
     }
 
+    // Shards are laid out one after another, so that different shards never share a cache line
+    ShardCounter* shard(u32 index) {
+        return (ShardCounter*)(values() + _capacity) + (size_t)index * _capacity;
+    }
+
+    // Group counters of a slot are adjacent
+    u64* group(u32 slot) {
+        return (u64*)shard(_shards) + (size_t)slot * _groups;
+    }
+
     void clear() {
-        memset(keys(), 0, (sizeof(u64) + sizeof(CallTraceSample)) * _capacity);
+        memset(keys(), 0, (sizeof(u64) + sizeof(CallTraceSample) + sizeof(ShardCounter) * _shards
+                           + sizeof(u64) * _groups) * _capacity);
         _size = 0;
     }
 };
 
 
-CallTrace CallTraceStorage::_overflow_trace = {1, {BCI_ERROR, (jmethodID)"[storage_overflow]"}};
+int GroupCounters::format(char* buf, size_t size, const u64* values) {
+    u64 cycles = values[GROUP_CYCLES];
+    u64 instructions = values[GROUP_INSTRUCTIONS];
+    if (cycles == 0 || instructions == 0) {
+        buf[0] = 0;
+        return 0;
+    }
+
+    double kinst = instructions / 1000.0;
+    return snprintf(buf, size, "IPC %.2f, cache-misses %.2f/ki, branch-misses %.2f/ki",
+                    (double)instructions / cycles,
+                    values[GROUP_CACHE_MISSES] / kinst,
+                    values[GROUP_BRANCH_MISSES] / kinst);
+}
+
+
+CallTrace CallTraceStorage::_overflow_trace = {1, OVERFLOW_TRACE_ID, {BCI_ERROR, (jmethodID)"[storage_overflow]"}};
 
-CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK) {
-    _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
+static const char EVICTED_FRAME[] = "[evicted]";
+
+CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK, MEM_TRACE_CHUNKS) {
+    _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY, 0, 0, false);
+    _shards = 0;
+    _groups = 0;
+    _memlimit = 0;
+    _trie = false;
+    _use_huge_pages = false;
+    _trie_roots = NULL;
     _overflow = 0;
+    _evicted = 0;
+    _compaction_target = NULL;
+    _garbage = NULL;
 }
 
 CallTraceStorage::~CallTraceStorage() {
     while (_current_table != NULL) {
         _current_table = _current_table->destroy();
     }
+    finishCompaction();
 }
 
 void CallTraceStorage::clear() {
+    finishCompaction();
+    _compaction_target = NULL;
+
     while (_current_table->prev() != NULL) {
         _current_table = _current_table->destroy();
     }
+
+    if (_current_table->shards() != _shards || _current_table->groups() != _groups
+        || _current_table->useHugePages() != _use_huge_pages) {
+        LongHashTable* table = LongHashTable::allocate(NULL, INITIAL_CAPACITY, _shards, _groups, _use_huge_pages);
+        if (table != NULL) {
+            _current_table->destroy();
+            _current_table = table;
+        }
+    }
+
     _current_table->clear();
     _allocator.clear();
+    _trie_roots = NULL;
     _overflow = 0;
+    _evicted = 0;
+    updateAllocatorLimit();
+}
+
+void CallTraceStorage::setHugePages(bool use_huge_pages) {
+    _use_huge_pages = use_huge_pages;
+    _allocator.setHugePages(use_huge_pages);
+}
+
+void CallTraceStorage::configureAs(CallTraceStorage* other) {
+    _shards = other->_shards;
+    _groups = other->_groups;
+    _memlimit = other->_memlimit;
+    _trie = other->_trie;
+    setHugePages(other->_use_huge_pages);
+}
+
+HugePages CallTraceStorage::tableHugePages() {
+    return _current_table->hugePages();
+}
+
+void CallTraceStorage::setMemLimit(size_t memlimit) {
+    _memlimit = memlimit;
+    updateAllocatorLimit();
+}
+
+size_t CallTraceStorage::tableMemory() {
+    size_t bytes = 0;
+    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        bytes += table->bytes();
+    }
+    return bytes;
+}
+
+size_t CallTraceStorage::usedMemory() {
+    return tableMemory() + _allocator.usedMemory();
+}
+
+// Whatever is left from the memory limit after hash tables, is available for traces
+void CallTraceStorage::updateAllocatorLimit() {
+    if (_memlimit == 0) {
+        _allocator.setLimit(0);
+    } else {
+        size_t tables = tableMemory();
+        _allocator.setLimit(tables < _memlimit ? _memlimit - tables : 1);
+    }
+}
+
+// New traces are not stored when the memory limit is exhausted.
+// Some space is still left in the last chunk for [evicted] traces.
+bool CallTraceStorage::isFull(LongHashTable* table) {
+    return _memlimit > 0 && (_allocator.limitReached() || table->size() >= table->capacity() / 8 * 7);
+}
+
+// Replaces the stack trace with [evicted] frame, preserving the thread frame if any
+int CallTraceStorage::evictedTrace(int num_frames, ASGCT_CallFrame* frames) {
+    ASGCT_CallFrame last = frames[num_frames - 1];
+    frames[0].bci = BCI_ERROR;
+    frames[0].method_id = (jmethodID)EVICTED_FRAME;
+    if (num_frames > 1 && last.bci == BCI_THREAD_ID) {
+        frames[1] = last;
+        return 2;
+    }
+    return 1;
 }
 
 void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
@@ -115,8 +309,9 @@ void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
         u32 capacity = table->capacity();
 
         for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
-                map[capacity - (INITIAL_CAPACITY - 1) + slot] = values[slot].trace;
+            if (keys[slot] != 0 && values[slot].trace != NULL) {
+                CallTrace* trace = values[slot].trace;
+                map[trace->id] = trace;
             }
         }
     }
@@ -128,12 +323,15 @@ void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
 
 void CallTraceStorage::collectSamples(std::vector<CallTraceSample*>& samples) {
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        foldShards(table);
+
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
         u32 capacity = table->capacity();
 
         for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
+            // Samples of migrated slots are moved to a newer table
+            if (keys[slot] != 0 && values[slot].trace != NULL && values[slot].samples != 0) {
                 samples.push_back(&values[slot]);
             }
         }
@@ -142,38 +340,260 @@ void CallTraceStorage::collectSamples(std::vector<CallTraceSample*>& samples) {
 
 void CallTraceStorage::collectSamples(std::map<u64, CallTraceSample>& map) {
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        foldShards(table);
+
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
         u32 capacity = table->capacity();
 
         for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
+            if (keys[slot] != 0 && values[slot].trace != NULL && values[slot].samples != 0) {
                 map[keys[slot]] += values[slot];
             }
         }
     }
 }
 
-// Adaptation of MurmurHash64A by Austin Appleby
+void CallTraceStorage::collectGroupCounters(std::map<u32, GroupCounters>& map) {
+    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        u32 groups = table->groups();
+        if (groups == 0) {
+            continue;
+        }
+
+        u64* keys = table->keys();
+        CallTraceSample* values = table->values();
+        u32 capacity = table->capacity();
+
+        for (u32 slot = 0; slot < capacity; slot++) {
+            if (keys[slot] != 0 && values[slot].trace != NULL && values[slot].samples != 0) {
+                u64* group = table->group(slot);
+                GroupCounters& c = map[values[slot].trace->id];
+                for (u32 i = 0; i < groups && i < MAX_GROUP_COUNTERS; i++) {
+                    c.values[i] += group[i];
+                }
+            }
+        }
+    }
+}
+
+// Moves per-shard counters into the shared CallTraceSample slots.
+// Must not run concurrently with put(), i.e. the profiler should be stopped.
+void CallTraceStorage::foldShards(LongHashTable* table) {
+    CallTraceSample* values = table->values();
+    u32 capacity = table->capacity();
+
+    for (u32 i = 0; i < table->shards(); i++) {
+        ShardCounter* shard = table->shard(i);
+        for (u32 slot = 0; slot < capacity; slot++) {
+            if (shard[slot].samples != 0) {
+                values[slot].samples += shard[slot].samples;
+                values[slot].counter += shard[slot].counter;
+                shard[slot].samples = 0;
+                shard[slot].counter = 0;
+            }
+        }
+    }
+}
+
+bool CallTraceStorage::startCompaction() {
+    if (_garbage != NULL || _current_table->prev() == NULL) {
+        return false;
+    }
+    _compaction_target = _current_table;
+    return true;
+}
+
+// Moves samples of all tables superseded by the compaction target into the target itself,
+// then unlinks superseded tables. Trace IDs do not change, since CallTrace objects are shared.
+// Requires that no put() has been writing to superseded tables since startCompaction().
+void CallTraceStorage::migrate() {
+    LongHashTable* target = _compaction_target;
+    if (target == NULL) {
+        return;
+    }
+
+    for (LongHashTable* table = target->prev(); table != NULL; table = table->prev()) {
+        foldShards(table);
+
+        u64* keys = table->keys();
+        CallTraceSample* values = table->values();
+        u32 capacity = table->capacity();
+
+        for (u32 slot = 0; slot < capacity; slot++) {
+            if (keys[slot] == 0 || values[slot].trace == NULL || values[slot].samples == 0) {
+                continue;
+            }
+            u64* group = table->groups() > 0 ? table->group(slot) : NULL;
+            if (!migrateSample(target, keys[slot], values[slot], group, table->groups())) {
+                // No room in the target table: keep superseded tables until the next attempt
+                return;
+            }
+            values[slot].samples = 0;
+            values[slot].counter = 0;
+            for (u32 i = 0; i < table->groups(); i++) {
+                group[i] = 0;
+            }
+        }
+    }
+
+    _garbage = target->prev();
+    target->unlinkPrev();
+    _compaction_target = NULL;
+    updateAllocatorLimit();
+}
+
+// Releases tables unlinked by migrate(). By this time, there must be no put() in progress
+// that could have started reading superseded tables before they were unlinked.
+void CallTraceStorage::finishCompaction() {
+    while (_garbage != NULL) {
+        _garbage = _garbage->destroy();
+    }
+}
+
+bool CallTraceStorage::migrateSample(LongHashTable* table, u64 hash, CallTraceSample& sample,
+                                     const u64* group, u32 groups) {
+    u64* keys = table->keys();
+    u32 capacity = table->capacity();
+    u32 slot = hash & (capacity - 1);
+    u32 step = 0;
+
+    while (keys[slot] != hash) {
+        if (keys[slot] == 0) {
+            if (!__sync_bool_compare_and_swap(&keys[slot], 0, hash)) {
+                continue;
+            }
+            if (table->incSize() == capacity * 3 / 4) {
+                expand(table);
+            }
+            table->values()[slot].trace = sample.trace;
+            break;
+        }
+
+        if (++step >= capacity) {
+            return false;
+        }
+        slot = (slot + step) & (capacity - 1);
+    }
+
+    CallTraceSample& s = table->values()[slot];
+    atomicInc(s.samples, sample.samples);
+    atomicInc(s.counter, sample.counter);
+
+    u64* target_group = table->group(slot);
+    for (u32 i = 0; i < groups && i < table->groups(); i++) {
+        atomicInc(target_group[i], group[i]);
+    }
+    return true;
+}
+
+void CallTraceStorage::expand(LongHashTable* table) {
+    u32 new_capacity = table->capacity() * 2;
+    if (_memlimit > 0 && usedMemory() + LongHashTable::getSize(new_capacity, _shards, _groups) > _memlimit) {
+        return;
+    }
+
+    LongHashTable* new_table = LongHashTable::allocate(table, new_capacity, _shards, _groups, _use_huge_pages);
+    if (new_table != NULL) {
+        if (__sync_bool_compare_and_swap(&_current_table, table, new_table)) {
+            updateAllocatorLimit();
+        } else {
+            // Not published, so nobody else could see it
+            new_table->destroy();
+        }
+    }
+}
+
+static const u64 M = 0xc6a4a7935bd1e995ULL;
+static const int R = 47;
+
+// Odd constants with well distributed bits
+static const u64 P0 = 0xa0761d6478bd642fULL;
+static const u64 P1 = 0xe7037ed1a0b428dbULL;
+static const u64 P2 = 0x8ebc6af09c88c6e3ULL;
+static const u64 P3 = 0x589965cc75374cc3ULL;
+
+#ifdef __SIZEOF_INT128__
+
+// Folded 64x64->128 bit multiplication, the core of wyhash by Wang Yi
+static inline u64 mum(u64 a, u64 b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (u64)r ^ (u64)(r >> 64);
+}
+
+// One multiplication mixes a whole 16-byte frame. Consecutive frames are distributed among
+// 4 independent lanes, so that multiplication chains of different lanes overlap in the pipeline.
+// Each lane depends on the order of its frames, and lanes are combined asymmetrically.
 u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
-    const u64 M = 0xc6a4a7935bd1e995ULL;
-    const int R = 47;
+    int len = num_frames * sizeof(ASGCT_CallFrame);
+    u64 h0 = len * M;
+    u64 h1 = h0 ^ P1;
+    u64 h2 = h0 ^ P2;
+    u64 h3 = h0 ^ P3;
+
+    const u64* data = (const u64*)frames;
+    const u64* end = data + len / 8;
+
+    for (; data + 8 <= end; data += 8) {
+        h0 = mum(data[0] ^ P0, data[1] ^ h0);
+        h1 = mum(data[2] ^ P0, data[3] ^ h1);
+        h2 = mum(data[4] ^ P0, data[5] ^ h2);
+        h3 = mum(data[6] ^ P0, data[7] ^ h3);
+    }
+
+    for (; data + 2 <= end; data += 2) {
+        h0 = mum(data[0] ^ P0, data[1] ^ h0);
+    }
+    if (data < end) {
+        h0 = mum(data[0] ^ P0, P1 ^ h0);
+    }
+
+    u64 h = mum(h0 ^ P1, h1 ^ P2) ^ mum(h2 ^ P3, h3 ^ P0);
+
+    h ^= h >> R;
+    h *= M;
+    h ^= h >> R;
+
+    return h;
+}
 
+#else
+
+static inline u64 mixWord(u64 h, u64 k) {
+    k *= M;
+    k ^= k >> R;
+    k *= M;
+    h ^= k;
+    return h * M;
+}
+
+// Adaptation of MurmurHash64A by Austin Appleby.
+// Words are distributed among 4 independent lanes, so that the multiplication chains
+// of different lanes overlap in the CPU pipeline. Every lane is a regular MurmurHash64A
+// with its own seed; the lanes are mixed together in a fixed order at the end.
+u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
     int len = num_frames * sizeof(ASGCT_CallFrame);
-    u64 h = len * M;
+    u64 h0 = len * M;
+    u64 h1 = h0 ^ P1;
+    u64 h2 = h0 ^ P2;
+    u64 h3 = h0 ^ P3;
 
     const u64* data = (const u64*)frames;
     const u64* end = data + len / 8;
 
-    while (data != end) {
-        u64 k = *data++;
-        k *= M;
-        k ^= k >> R;
-        k *= M;
-        h ^= k;
-        h *= M;
+    for (; data + 4 <= end; data += 4) {
+        h0 = mixWord(h0, data[0]);
+        h1 = mixWord(h1, data[1]);
+        h2 = mixWord(h2, data[2]);
+        h3 = mixWord(h3, data[3]);
     }
 
+    if (data < end) h0 = mixWord(h0, *data++);
+    if (data < end) h1 = mixWord(h1, *data++);
+    if (data < end) h2 = mixWord(h2, *data++);
+
+    u64 h = mixWord(mixWord(mixWord(h0, h1), h2), h3);
+
     if (len & 4) {
         h ^= *(u32*)data;
         h *= M;
@@ -186,11 +606,14 @@ u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
     return h;
 }
 
-CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames) {
+#endif // __SIZEOF_INT128__
+
+CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames, u32 id, u32 shard) {
     const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
-    CallTrace* buf = (CallTrace*)_allocator.alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
+    CallTrace* buf = (CallTrace*)_allocator.alloc(header_size + num_frames * sizeof(ASGCT_CallFrame), shard);
     if (buf != NULL) {
         buf->num_frames = num_frames;
+        buf->id = id;
         // Do not use memcpy inside signal handler
         for (int i = 0; i < num_frames; i++) {
             buf->frames[i] = frames[i];
@@ -199,26 +622,161 @@ CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* fra
     return buf;
 }
 
-CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
-    u64* keys = table->keys();
-    u32 capacity = table->capacity();
-    u32 slot = hash & (capacity - 1);
-    u32 step = 0;
+static bool sameFrame(const ASGCT_CallFrame& f1, const ASGCT_CallFrame& f2) {
+    return f1.method_id == f2.method_id && f1.bci == f2.bci;
+}
 
-    while (keys[slot] != hash) {
-        if (keys[slot] == 0) {
-            return NULL;
+// Looks for a run that continues 'attach' frames of the parent with the given frame.
+// Scans the first MAX_TRIE_SIBLINGS children only and sets 'crowded' if there are more.
+static TraceNode* findChild(TraceNode* node, u32 attach, const ASGCT_CallFrame& frame, bool& crowded) {
+    for (int scanned = 0; node != NULL; node = node->next) {
+        if (node->attach == attach && sameFrame(node->frames[0], frame)) {
+            return node;
         }
-        if (++step >= capacity) {
+        if (++scanned >= MAX_TRIE_SIBLINGS) {
+            crowded = true;
             return NULL;
         }
-        slot = (slot + step) & (capacity - 1);
     }
+    return NULL;
+}
+
+// Stores the call trace as a path in the prefix tree, sharing runs with already known traces.
+// Concurrent insertion of the same frames may occasionally create duplicate nodes, which is harmless.
+// Sibling lists are scanned linearly in a signal handler, so a trace that passes through
+// a node with too many children is stored flat instead.
+CallTrace* CallTraceStorage::storeCompactTrace(int num_frames, ASGCT_CallFrame* frames, u32 id, u32 shard) {
+    TraceNode* node = NULL;
+    u32 matched = 0;  // frames of 'node' that the trace shares
+    TraceNode* run = NULL;
+    int i = num_frames - 1;
+
+    while (i >= 0) {
+        if (node != NULL && matched < node->length && sameFrame(node->frames[matched], frames[i])) {
+            matched++;
+            i--;
+            continue;
+        }
+
+        TraceNode* volatile* children = node != NULL ? &node->children : &_trie_roots;
+        TraceNode* head = *children;
+        bool crowded = false;
+        TraceNode* child = findChild(head, matched, frames[i], crowded);
+        if (child != NULL) {
+            // A run created for a lost race is simply abandoned
+            node = child;
+            matched = 1;
+            i--;
+            run = NULL;
+            continue;
+        } else if (crowded) {
+            return storeCallTrace(num_frames, frames, id, shard);
+        }
+
+        // The rest of the trace becomes a new run
+        if (run == NULL) {
+            u32 length = i + 1;
+            run = (TraceNode*)_allocator.alloc(sizeof(TraceNode) + (length - 1) * sizeof(ASGCT_CallFrame), shard);
+            if (run == NULL) {
+                return NULL;
+            }
+            run->parent = node;
+            run->children = NULL;
+            run->attach = matched;
+            run->length = length;
+            // Do not use memcpy inside signal handler
+            for (u32 j = 0; j < length; j++) {
+                run->frames[j] = frames[i - j];
+            }
+        }
+
+        run->next = head;
+        if (__sync_bool_compare_and_swap(children, head, run)) {
+            node = run;
+            matched = run->length;
+            break;
+        }
+    }
+
+    CompactTrace* trace = (CompactTrace*)_allocator.alloc(sizeof(CompactTrace), shard);
+    if (trace == NULL) {
+        return NULL;
+    }
+
+    trace->num_frames = COMPACT_TRACE;
+    trace->id = id;
+    trace->depth = num_frames;
+    trace->leaf_length = matched;
+    trace->leaf = node;
+    return (CallTrace*)trace;
+}
+
+TraceExpander::~TraceExpander() {
+    if (_buf != NULL) {
+        const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
+        MemoryUsage::release(MEM_EXPANDED_TRACES, header_size + _capacity * sizeof(ASGCT_CallFrame));
+        free(_buf);
+    }
+}
+
+CallTrace* TraceExpander::expand(CallTrace* trace) {
+    if (trace->num_frames != COMPACT_TRACE) {
+        return trace;
+    }
+
+    CompactTrace* compact = (CompactTrace*)trace;
+    const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
+
+    if (compact->depth > _capacity) {
+        CallTrace* buf = (CallTrace*)realloc(_buf, header_size + compact->depth * sizeof(ASGCT_CallFrame));
+        if (buf == NULL) {
+            // The stored trace stays intact; only this output loses its frames
+            return &CallTraceStorage::_overflow_trace;
+        }
+        MemoryUsage::allocate(MEM_EXPANDED_TRACES, (compact->depth - _capacity) * sizeof(ASGCT_CallFrame)
+                              + (_buf == NULL ? header_size : 0), _buf == NULL ? 1 : 0);
+        _buf = buf;
+        _capacity = compact->depth;
+    }
+
+    _buf->num_frames = compact->depth;
+    _buf->id = compact->id;
+    TraceNode* node = compact->leaf;
+    u32 length = compact->leaf_length;
+    for (int i = 0; node != NULL; node = node->parent) {
+        while (length > 0) {
+            _buf->frames[i++] = node->frames[--length];
+        }
+        length = node->attach;
+    }
+    return _buf;
+}
 
-    return table->values()[slot].trace;
+CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
+    for (; table != NULL; table = table->prev()) {
+        u64* keys = table->keys();
+        u32 capacity = table->capacity();
+        u32 slot = hash & (capacity - 1);
+        u32 step = 0;
+
+        while (keys[slot] != 0) {
+            if (keys[slot] == hash) {
+                CallTrace* trace = table->values()[slot].trace;
+                if (trace != NULL) {
+                    return trace;
+                }
+                break;
+            }
+            if (++step >= capacity) {
+                break;
+            }
+            slot = (slot + step) & (capacity - 1);
+        }
+    }
+    return NULL;
 }
 
-u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
+u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter, u32 shard, const u64* group) {
     u64 hash = calcHash(num_frames, frames);
 
     LongHashTable* table = _current_table;
@@ -229,22 +787,32 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
 
     while (keys[slot] != hash) {
         if (keys[slot] == 0) {
+            // Migrate from previous tables to save space and to keep the same trace ID
+            CallTrace* trace = findCallTrace(table->prev(), hash);
+            if (trace == NULL && isFull(table) && frames[0].method_id != (jmethodID)EVICTED_FRAME) {
+                // Out of memory budget: account the sample to [evicted] trace instead
+                atomicInc(_evicted);
+                num_frames = evictedTrace(num_frames, frames);
+                return put(num_frames, frames, counter, shard, group);
+            }
+
             if (!__sync_bool_compare_and_swap(&keys[slot], 0, hash)) {
                 continue;
             }
 
             // Increment the table size, and if the load factor exceeds 0.75, reserve a new table
             if (table->incSize() == capacity * 3 / 4) {
-                LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2);
-                if (new_table != NULL) {
-                    __sync_bool_compare_and_swap(&_current_table, table, new_table);
-                }
+                expand(table);
             }
 
-            // Migrate from a previous table to save space
-            CallTrace* trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), hash);
             if (trace == NULL) {
-                trace = storeCallTrace(num_frames, frames);
+                u32 id = capacity - (INITIAL_CAPACITY - 1) + slot;
+                trace = _trie ? storeCompactTrace(num_frames, frames, id, shard)
+                              : storeCallTrace(num_frames, frames, id, shard);
+                if (trace == NULL) {
+                    trace = &_overflow_trace;
+                    atomicInc(_overflow);
+                }
             }
             table->values()[slot].trace = trace;
             break;
@@ -259,9 +827,33 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
         slot = (slot + step) & (capacity - 1);
     }
 
-    CallTraceSample& s = table->values()[slot];
-    atomicInc(s.samples);
-    atomicInc(s.counter, counter);
+    // The slot may have been just claimed by another thread that has not yet published the trace
+    CallTrace* trace;
+    for (int spins = 0; (trace = *(CallTrace* volatile*)&table->values()[slot].trace) == NULL; spins++) {
+        if (spins >= MAX_PUBLISH_SPINS) {
+            atomicInc(_overflow);
+            return OVERFLOW_TRACE_ID;
+        }
+        spinPause();
+    }
+
+    if (shard < table->shards()) {
+        // The caller owns the shard exclusively, so no atomic operations are needed
+        ShardCounter& c = table->shard(shard)[slot];
+        c.samples++;
+        c.counter += counter;
+    } else {
+        CallTraceSample& s = table->values()[slot];
+        atomicInc(s.samples);
+        atomicInc(s.counter, counter);
+    }
+
+    if (group != NULL) {
+        u64* g = table->group(slot);
+        for (u32 i = 0; i < table->groups(); i++) {
+            atomicInc(g[i], group[i]);
+        }
+    }
 
-    return capacity - (INITIAL_CAPACITY - 1) + slot;
+    return trace->id;
 }
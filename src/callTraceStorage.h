@@ -25,9 +25,20 @@
 
 
 class LongHashTable;
+struct TraceNode;
+
+// Hardware counters read together with each sample in perf_events group mode
+enum GroupCounter {
+    GROUP_CYCLES,
+    GROUP_INSTRUCTIONS,
+    GROUP_CACHE_MISSES,
+    GROUP_BRANCH_MISSES,
+    MAX_GROUP_COUNTERS
+};
 
 struct CallTrace {
     int num_frames;
+    u32 id;
     ASGCT_CallFrame frames[1];
 };
 
@@ -48,28 +59,144 @@ struct CallTraceSample {
     }
 };
 
+struct GroupCounters {
+    u64 values[MAX_GROUP_COUNTERS];
+
+    GroupCounters() {
+        for (int i = 0; i < MAX_GROUP_COUNTERS; i++) values[i] = 0;
+    }
+
+    GroupCounters& operator+=(const u64* other) {
+        for (int i = 0; i < MAX_GROUP_COUNTERS; i++) values[i] += other[i];
+        return *this;
+    }
+
+    // Instructions per cycle and misses per 1000 instructions, e.g. "IPC 0.85, cache-misses 12.30/ki, ..."
+    static int format(char* buf, size_t size, const u64* values);
+};
+
+// Rebuilds frames of compact call traces stored in 'trie' mode, one trace at a time.
+// The returned trace lives in a scratch buffer and is valid only until the next expand();
+// flat traces are returned as is. Used outside of signal handlers only.
+class TraceExpander {
+  private:
+    CallTrace* _buf;
+    int _capacity;
+
+  public:
+    TraceExpander() : _buf(NULL), _capacity(0) {
+    }
+
+    ~TraceExpander();
+
+    CallTrace* expand(CallTrace* trace);
+};
+
 class CallTraceStorage {
   private:
     static CallTrace _overflow_trace;
 
     LinearAllocator _allocator;
     LongHashTable* _current_table;
+    u32 _shards;
+    u32 _groups;
+    size_t _memlimit;
+    bool _trie;
+    bool _use_huge_pages;
+    TraceNode* volatile _trie_roots;
     u64 _overflow;
+    u64 _evicted;
+
+    // Superseded tables are reclaimed in several steps, see Profiler::compactCallTraces
+    LongHashTable* _compaction_target;
+    LongHashTable* _garbage;
 
-    u64 calcHash(int num_frames, ASGCT_CallFrame* frames);
-    CallTrace* storeCallTrace(int num_frames, ASGCT_CallFrame* frames);
+    CallTrace* storeCallTrace(int num_frames, ASGCT_CallFrame* frames, u32 id, u32 shard);
+    CallTrace* storeCompactTrace(int num_frames, ASGCT_CallFrame* frames, u32 id, u32 shard);
     CallTrace* findCallTrace(LongHashTable* table, u64 hash);
+    void foldShards(LongHashTable* table);
+    bool migrateSample(LongHashTable* table, u64 hash, CallTraceSample& sample, const u64* group, u32 groups);
+    void expand(LongHashTable* table);
+    size_t tableMemory();
+    void updateAllocatorLimit();
+    bool isFull(LongHashTable* table);
+    int evictedTrace(int num_frames, ASGCT_CallFrame* frames);
+
+    friend class TraceExpander;
 
   public:
     CallTraceStorage();
     ~CallTraceStorage();
 
+    // The 64-bit hash is the only key of a call trace in the hash table
+    static u64 calcHash(int num_frames, ASGCT_CallFrame* frames);
+
+    // Number of private counter shards for tables allocated from now on;
+    // takes full effect after clear()
+    void setShards(u32 shards) {
+        _shards = shards;
+    }
+
+    // Number of group counters accumulated per trace besides the main counter;
+    // takes full effect after clear()
+    void setGroupCounters(u32 groups) {
+        _groups = groups;
+    }
+
+    u32 groupCounters() {
+        return _groups;
+    }
+
+    // Memory budget for hash tables and stored traces, 0 means unlimited.
+    // A lower limit does not release memory already used, but stops further growth.
+    void setMemLimit(size_t memlimit);
+
+    // Store new call traces in a prefix tree, so that common parts of stacks are shared.
+    // Collected traces may then be compact; their frames are rebuilt with TraceExpander.
+    void setTrie(bool trie) {
+        _trie = trie;
+    }
+
+    // Back hash tables and trace chunks allocated from now on with huge pages, if possible
+    void setHugePages(bool use_huge_pages);
+
+    // Copies all settings of another storage; takes full effect after clear()
+    void configureAs(CallTraceStorage* other);
+
+    HugePages tableHugePages();
+
+    HugePages chunkHugePages() {
+        return _allocator.hugePages();
+    }
+
+    size_t memLimit() {
+        return _memlimit;
+    }
+
+    size_t usedMemory();
+
+    // Number of samples whose traces were not stored because of the memory limit
+    u64 evictedSamples() {
+        return _evicted;
+    }
+
     void clear();
     void collectTraces(std::map<u32, CallTrace*>& map);
     void collectSamples(std::vector<CallTraceSample*>& samples);
     void collectSamples(std::map<u64, CallTraceSample>& map);
+    void collectGroupCounters(std::map<u32, GroupCounters>& map);
+
+    // The caller must guarantee that no other thread uses the same shard concurrently.
+    // New traces are allocated from the private slab of the given shard.
+    // Samples with shard < number of counter shards are counted without atomics.
+    // Group counters, if any, are always added atomically.
+    u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter, u32 shard, const u64* group = NULL);
 
-    u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter);
+    // Reclamation of superseded tables, performed outside of signal handlers.
+    // All in-flight put() calls must complete after startCompaction() and after migrate().
+    bool startCompaction();
+    void migrate();
+    void finishCompaction();
 };
 
 #endif // _CALLTRACESTORAGE
@@ -14,50 +14,198 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include "arch.h"
 #include "codeCache.h"
+#include "memoryUsage.h"
+#include "symbols.h"
 
 
+CodeBlobArray* CodeBlobArray::allocate(int capacity) {
+    CodeBlobArray* array = (CodeBlobArray*)malloc(sizeof(CodeBlobArray) + capacity * sizeof(CodeBlob));
+    MemoryUsage::allocate(MEM_CODE_BLOBS, capacity * sizeof(CodeBlob));
+    array->_next_retired = NULL;
+    array->_capacity = capacity;
+    array->_sorted = 0;
+    array->_count = 0;
+    return array;
+}
+
+void CodeBlobArray::destroy(CodeBlobArray* array) {
+    MemoryUsage::release(MEM_CODE_BLOBS, array->_capacity * sizeof(CodeBlob));
+    free(array);
+}
+
+
+CodeCache::CodeCache() {
+    _array = CodeBlobArray::allocate(INITIAL_CODE_CACHE_CAPACITY);
+    _retired = NULL;
+    _min_address = NO_MIN_ADDRESS;
+    _max_address = NO_MAX_ADDRESS;
+}
+
+CodeCache::~CodeCache() {
+    CodeBlobArray::destroy(_array);
+    freeArrays(_retired);
+}
+
+// Readers may still be looking at the old array, so it is only retired, not freed
+void CodeCache::publish(CodeBlobArray* array) {
+    CodeBlobArray* old_array = _array;
+    __sync_synchronize();
+    _array = array;
+
+    old_array->_next_retired = _retired;
+    _retired = old_array;
+}
+
+CodeBlobArray* CodeCache::detachRetired() {
+    CodeBlobArray* retired = _retired;
+    _retired = NULL;
+    return retired;
+}
+
+void CodeCache::freeArrays(CodeBlobArray* list) {
+    while (list != NULL) {
+        CodeBlobArray* next = list->_next_retired;
+        CodeBlobArray::destroy(list);
+        list = next;
+    }
+}
+
+void CodeCache::reset() {
+    publish(CodeBlobArray::allocate(INITIAL_CODE_CACHE_CAPACITY));
+}
+
 void CodeCache::expand() {
-    CodeBlob* old_blobs = _blobs;
-    CodeBlob* new_blobs = new CodeBlob[_capacity * 2];
+    CodeBlobArray* array = _array;
+    CodeBlobArray* new_array = CodeBlobArray::allocate(array->_capacity * 2);
+    memcpy(new_array->blobs(), array->blobs(), array->_count * sizeof(CodeBlob));
+    new_array->_sorted = array->_sorted;
+    new_array->_count = array->_count;
+    publish(new_array);
+}
 
+void CodeCache::append(const void* start, const void* end, jmethodID method) {
+    if (_array->_count >= _array->_capacity) {
+        expand();
+    }
+
+    CodeBlobArray* array = _array;
+    CodeBlob* blob = array->blobs() + array->_count;
+    blob->_start = start;
+    blob->_end = end;
+    blob->_method = method;
+
+    // The blob must be complete before a reader can see it
+    __sync_synchronize();
+    array->_count = array->_count + 1;
+}
+
+// Copies blobs that have not been removed. Returns the number of copied blobs.
+static int copyLive(CodeBlob* dst, const CodeBlob* src, int count) {
     int live = 0;
-    for (int i = 0; i < _count; i++) {
-        if (_blobs[i]._method != NULL) {
-            new_blobs[live++] = _blobs[i];
+    for (int i = 0; i < count; i++) {
+        if (src[i]._method != NULL) {
+            dst[live++] = src[i];
         }
     }
+    return live;
+}
+
+// Publishes a new array with removed blobs dropped and all the rest in address order.
+// A small unordered tail is sorted aside and merged into the sorted part in linear time.
+void CodeCache::sortBlobs() {
+    CodeBlobArray* array = _array;
+    const CodeBlob* blobs = array->blobs();
+    int sorted = array->_sorted;
+    int count = array->_count;
+    int tail_count = count - sorted;
 
-    _count = live;
-    if (live * 2 > _capacity) {
-        _capacity = live * 2;
+    CodeBlobArray* new_array = CodeBlobArray::allocate(array->_capacity);
+    CodeBlob* dst = new_array->blobs();
+    int new_count;
+
+    if (sorted == 0 || tail_count > MAX_UNSORTED_BLOBS) {
+        // Bulk load: sort everything at once
+        new_count = copyLive(dst, blobs, count);
+        qsort(dst, new_count, sizeof(CodeBlob), CodeBlob::comparator);
+    } else {
+        CodeBlob tail[MAX_UNSORTED_BLOBS];
+        int tail_live = copyLive(tail, blobs + sorted, tail_count);
+        qsort(tail, tail_live, sizeof(CodeBlob), CodeBlob::comparator);
+
+        // Of equal blobs, the sorted one goes first, as the newer one takes precedence in find()
+        new_count = 0;
+        int i = 0;
+        int j = 0;
+        while (i < sorted || j < tail_live) {
+            if (j >= tail_live || (i < sorted && CodeBlob::comparator(&blobs[i], &tail[j]) <= 0)) {
+                if (blobs[i]._method != NULL) {
+                    dst[new_count++] = blobs[i];
+                }
+                i++;
+            } else {
+                dst[new_count++] = tail[j++];
+            }
+        }
     }
-    _blobs = new_blobs;
-    delete[] old_blobs;
+
+    new_array->_sorted = new_count;
+    new_array->_count = new_count;
+    publish(new_array);
 }
 
 void CodeCache::add(const void* start, int length, jmethodID method, bool update_bounds) {
-    if (_count >= _capacity) {
-        expand();
-    }
-
     const void* end = (const char*)start + length;
-    _blobs[_count]._start = start;
-    _blobs[_count]._end = end;
-    _blobs[_count]._method = method;
-    _count++;
+    append(start, end, method);
+
+    // New blobs are collected in the unordered tail and merged into the sorted part in batches
+    if (_array->_count - _array->_sorted >= MAX_UNSORTED_BLOBS) {
+        sortBlobs();
+    }
 
     if (update_bounds) {
         updateBounds(start, end);
     }
 }
 
+// Index of the first sorted blob that starts at or above the given address
+static int lowerBound(const CodeBlob* blobs, int sorted, const void* address) {
+    int low = 0;
+    int high = sorted - 1;
+
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (blobs[mid]._start < address) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+// Removed blobs are only marked; they are dropped on the next sortBlobs()
 void CodeCache::remove(const void* start, jmethodID method) {
-    for (int i = 0; i < _count; i++) {
-        if (_blobs[i]._start == start && _blobs[i]._method == method) {
-            _blobs[i]._method = NULL;
+    CodeBlobArray* array = _array;
+    CodeBlob* blobs = array->blobs();
+    int sorted = array->_sorted;
+    int count = array->_count;
+
+    for (int i = sorted; i < count; i++) {
+        if (blobs[i]._start == start && blobs[i]._method == method) {
+            blobs[i]._method = NULL;
+            return;
+        }
+    }
+
+    for (int i = lowerBound(blobs, sorted, start); i < sorted && blobs[i]._start == start; i++) {
+        if (blobs[i]._method == method) {
+            blobs[i]._method = NULL;
             return;
         }
     }
@@ -68,11 +216,42 @@ void CodeCache::updateBounds(const void* start, const void* end) {
     if (end > _max_address) _max_address = end;
 }
 
+// Lock-free: may run in a signal handler concurrently with add() and remove()
 jmethodID CodeCache::find(const void* address) {
-    for (int i = 0; i < _count; i++) {
-        CodeBlob* cb = _blobs + i;
-        if (address >= cb->_start && address < cb->_end && cb->_method != NULL) {
-            return _blobs[i]._method;
+    CodeBlobArray* array = _array;
+    int count = array->_count;
+    rmb();
+    const CodeBlob* blobs = array->blobs();
+    int sorted = array->_sorted;
+
+    // Recently added blobs take precedence over a stale blob at the same address
+    for (int i = sorted; i < count; i++) {
+        const CodeBlob* cb = blobs + i;
+        jmethodID method = cb->_method;
+        if (address >= cb->_start && address < cb->_end && method != NULL) {
+            return method;
+        }
+    }
+
+    int low = 0;
+    int high = sorted - 1;
+
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (blobs[mid]._start <= address) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    // Live blobs never overlap, but an unloaded method may stay here until its removal is reported.
+    // So the blob containing the address is either the last one starting below it or the previous one.
+    for (int i = high; i >= 0 && i >= high - 1; i--) {
+        const CodeBlob* cb = blobs + i;
+        jmethodID method = cb->_method;
+        if (address < cb->_end && method != NULL) {
+            return method;
         }
     }
     return NULL;
@@ -81,66 +260,282 @@ jmethodID CodeCache::find(const void* address) {
 
 NativeCodeCache::NativeCodeCache(const char* name, const void* min_address, const void* max_address) {
     _name = strdup(name);
+    MemoryUsage::allocate(MEM_SYMBOL_NAMES, strlen(_name) + 1);
+    _name_index = NULL;
+    _lazy_file = NULL;
+    _lazy_base = NULL;
+    _symbols_requested = false;
+    _symbol_image = NULL;
+    _symbol_image_size = 0;
+    _image_base = NULL;
+    _image_end = NULL;
+    _dwarf_table = NULL;
+    _dwarf_table_length = 0;
+    _dwarf_parsed = false;
     _min_address = min_address;
     _max_address = max_address;
 }
 
 NativeCodeCache::~NativeCodeCache() {
-    for (int i = 0; i < _count; i++) {
-        free(_blobs[i]._method);
+    const CodeBlob* blobs = _array->blobs();
+    for (int i = 0; i < _array->_count; i++) {
+        char* name = (char*)blobs[i]._method;
+        if (ownsName(name)) {
+            MemoryUsage::release(MEM_SYMBOL_NAMES, strlen(name) + 1);
+            free(name);
+        }
     }
+    if (_symbol_image != NULL) {
+        MemoryUsage::release(MEM_SYMBOL_NAMES, _symbol_image_size);
+        munmap((void*)_symbol_image, _symbol_image_size);
+    }
+    if (_dwarf_table != NULL) {
+        MemoryUsage::release(MEM_UNWIND_TABLES, _dwarf_table_length * sizeof(FrameDesc));
+        free(_dwarf_table);
+    }
+    MemoryUsage::release(MEM_SYMBOL_NAMES, strlen(_name) + 1);
     free(_name);
+    free(_lazy_file);
+    invalidateNameIndex();
+}
+
+void NativeCodeCache::setLazy(const char* file, const char* base) {
+    _lazy_file = strdup(file);
+    _lazy_base = base;
+}
+
+// Takes over symbols parsed into another cache. Readers may run concurrently in a signal handler,
+// but they do not look at the blobs until _lazy_file is cleared, which happens last.
+void NativeCodeCache::adoptSymbols(NativeCodeCache* other) {
+    invalidateNameIndex();
+
+    // The old array is freed together with the other cache
+    CodeBlobArray* old_array = _array;
+    __sync_synchronize();
+    _array = other->_array;
+    other->_array = old_array;
+
+    const char* old_image = _symbol_image;
+    size_t old_image_size = _symbol_image_size;
+    _symbol_image = other->_symbol_image;
+    _symbol_image_size = other->_symbol_image_size;
+    other->_symbol_image = old_image;
+    other->_symbol_image_size = old_image_size;
+
+    // Pairs with binarySearch()
+    char* lazy_file = _lazy_file;
+    __sync_synchronize();
+    _lazy_file = NULL;
+    free(lazy_file);
 }
 
 void NativeCodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
     char* name_copy = strdup(name);
+    MemoryUsage::allocate(MEM_SYMBOL_NAMES, strlen(name_copy) + 1);
     // Replace non-printable characters
     for (char* s = name_copy; *s != 0; s++) {
         if (*s < ' ') *s = '?';
     }
-    CodeCache::add(start, length, (jmethodID)name_copy, update_bounds);
+    const void* end = (const char*)start + length;
+    invalidateNameIndex();
+    append(start, end, (jmethodID)name_copy);
+
+    if (update_bounds) {
+        updateBounds(start, end);
+    }
+}
+
+bool NativeCodeCache::attachSymbolImage(const void* image, size_t size) {
+    if (_symbol_image != NULL) {
+        return false;
+    }
+    _symbol_image = (const char*)image;
+    _symbol_image_size = size;
+    MemoryUsage::allocate(MEM_SYMBOL_NAMES, size);
+    return true;
+}
+
+// The name must be already sanitized and outlive the cache, i.e. point into the attached image
+void NativeCodeCache::addMapped(const void* start, int length, const char* name) {
+    invalidateNameIndex();
+    append(start, (const char*)start + length, (jmethodID)name);
+}
+
+void NativeCodeCache::setDwarfTable(FrameDesc* table, int length) {
+    _dwarf_parsed = true;
+    if (table != NULL) {
+        MemoryUsage::allocate(MEM_UNWIND_TABLES, length * sizeof(FrameDesc));
+        _dwarf_table = table;
+        __sync_synchronize();
+        _dwarf_table_length = length;
+    }
+}
+
+// Returns the unwind rule for the given PC, or NULL if the library has no CFI for it
+FrameDesc* NativeCodeCache::findFrameDesc(const void* pc) {
+    // Pairs with setDwarfTable()
+    int length = _dwarf_table_length;
+    rmb();
+    const FrameDesc* table = _dwarf_table;
+
+    u32 target = (u32)((const char*)pc - _image_base);
+    int low = 0;
+    int high = length - 1;
+
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (table[mid].loc < target) {
+            low = mid + 1;
+        } else if (table[mid].loc > target) {
+            high = mid - 1;
+        } else {
+            return (FrameDesc*)&table[mid];
+        }
+    }
+
+    return low > 0 ? (FrameDesc*)&table[low - 1] : NULL;
 }
 
 void NativeCodeCache::sort() {
-    if (_count == 0) return;
+    if (_array->_count == 0) return;
 
-    qsort(_blobs, _count, sizeof(CodeBlob), CodeBlob::comparator);
+    invalidateNameIndex();
+    sortBlobs();
 
-    if (_min_address == NO_MIN_ADDRESS) _min_address = _blobs[0]._start;
-    if (_max_address == NO_MAX_ADDRESS) _max_address = _blobs[_count - 1]._end;
+    // Libraries are sorted before they are published, so no reader can see the old arrays
+    freeArrays(detachRetired());
+
+    const CodeBlob* blobs = _array->blobs();
+    int count = _array->_count;
+    if (_min_address == NO_MIN_ADDRESS) _min_address = blobs[0]._start;
+    if (_max_address == NO_MAX_ADDRESS) _max_address = blobs[count - 1]._end;
 }
 
 const char* NativeCodeCache::binarySearch(const void* address) {
+    if (_lazy_file != NULL) {
+        // Symbols will be loaded outside the signal handler; until then, the frame is named after the library
+        _symbols_requested = true;
+        return _name;
+    }
+    rmb();
+
+    CodeBlobArray* array = _array;
+    int count = array->_count;
+    rmb();
+    const CodeBlob* blobs = array->blobs();
+
     int low = 0;
-    int high = _count - 1;
+    int high = count - 1;
 
     while (low <= high) {
         int mid = (unsigned int)(low + high) >> 1;
-        if (_blobs[mid]._end <= address) {
+        if (blobs[mid]._end <= address) {
             low = mid + 1;
-        } else if (_blobs[mid]._start > address) {
+        } else if (blobs[mid]._start > address) {
             high = mid - 1;
         } else {
-            return (const char*)_blobs[mid]._method;
+            return (const char*)blobs[mid]._method;
         }
     }
 
     // Symbols with zero size can be valid functions: e.g. ASM entry points or kernel code.
     // Also, in some cases (endless loop) the return address may point beyond the function.
-    if (low > 0 && (_blobs[low - 1]._start == _blobs[low - 1]._end || _blobs[low - 1]._end == address)) {
-        return (const char*)_blobs[low - 1]._method;
+    if (low > 0 && (blobs[low - 1]._start == blobs[low - 1]._end || blobs[low - 1]._end == address)) {
+        return (const char*)blobs[low - 1]._method;
     }
     return _name;
 }
 
-const void* NativeCodeCache::findSymbol(const char* name) {
-    for (int i = 0; i < _count; i++) {
-        const char* blob_name = (const char*)_blobs[i]._method;
-        if (blob_name != NULL && strcmp(blob_name, name) == 0) {
-            return _blobs[i]._start;
+// Orders blob indices by symbol name; equal names keep the address order
+class NameComparator {
+  private:
+    const CodeBlob* _blobs;
+
+  public:
+    NameComparator(const CodeBlob* blobs) : _blobs(blobs) {
+    }
+
+    bool operator()(int i1, int i2) const {
+        int result = strcmp((const char*)_blobs[i1]._method, (const char*)_blobs[i2]._method);
+        return result < 0 || (result == 0 && i1 < i2);
+    }
+};
+
+int* NativeCodeCache::nameIndex() {
+    int* index = _name_index;
+    if (index == NULL) {
+        int count = _array->_count;
+        index = (int*)malloc(count * sizeof(int));
+        if (index == NULL) {
+            return NULL;
         }
+        for (int i = 0; i < count; i++) {
+            index[i] = i;
+        }
+        std::sort(index, index + count, NameComparator(_array->blobs()));
+
+        if (!__sync_bool_compare_and_swap(&_name_index, NULL, index)) {
+            free(index);
+            return _name_index;
+        }
+        MemoryUsage::allocate(MEM_CODE_BLOBS, count * sizeof(int));
     }
-    return NULL;
+    return index;
+}
+
+void NativeCodeCache::invalidateNameIndex() {
+    if (_name_index != NULL) {
+        MemoryUsage::release(MEM_CODE_BLOBS, _array->_count * sizeof(int));
+        free(_name_index);
+        _name_index = NULL;
+    }
+}
+
+// Returns the index of the lowest addressed blob whose name matches, or -1
+int NativeCodeCache::findByName(const char* name, size_t len, bool exact) {
+    if (_lazy_file != NULL) {
+        Symbols::loadSymbols(this);
+    }
+
+    int* index = nameIndex();
+    if (index == NULL) {
+        return -1;
+    }
+
+    // All names starting with the given prefix form a contiguous range in the index
+    const CodeBlob* blobs = _array->blobs();
+    int count = _array->_count;
+    int low = 0;
+    int high = count - 1;
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (strncmp((const char*)blobs[index[mid]]._method, name, len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    int result = -1;
+    for (int i = low; i < count; i++) {
+        const char* blob_name = (const char*)blobs[index[i]]._method;
+        if (strncmp(blob_name, name, len) != 0) {
+            break;
+        }
+        if (exact) {
+            // Exact matches come first, lowest address first
+            return blob_name[len] == 0 ? index[i] : -1;
+        }
+        if (result < 0 || index[i] < result) {
+            result = index[i];
+        }
+    }
+    return result;
+}
+
+const void* NativeCodeCache::findSymbol(const char* name) {
+    int i = findByName(name, strlen(name), true);
+    return i >= 0 ? _array->blobs()[i]._start : NULL;
 }
 
 const void* NativeCodeCache::findSymbolByPrefix(const char* prefix) {
@@ -148,11 +543,75 @@ const void* NativeCodeCache::findSymbolByPrefix(const char* prefix) {
 }
 
 const void* NativeCodeCache::findSymbolByPrefix(const char* prefix, int prefix_len) {
-    for (int i = 0; i < _count; i++) {
-        const char* blob_name = (const char*)_blobs[i]._method;
-        if (blob_name != NULL && strncmp(blob_name, prefix, prefix_len) == 0) {
-            return _blobs[i]._start;
+    int i = findByName(prefix, prefix_len, false);
+    return i >= 0 ? _array->blobs()[i]._start : NULL;
+}
+
+
+static int compareRanges(const void* r1, const void* r2) {
+    const void* s1 = ((const LibraryRange*)r1)->start;
+    const void* s2 = ((const LibraryRange*)r2)->start;
+    return s1 < s2 ? -1 : s1 > s2 ? 1 : 0;
+}
+
+NativeLibraryIndex::NativeLibraryIndex(int capacity) {
+    _ranges = new LibraryRange[capacity];
+    _capacity = capacity;
+    _count = 0;
+    _indexed_libs = 0;
+    _version = 0;
+}
+
+NativeLibraryIndex::~NativeLibraryIndex() {
+    delete[] _ranges;
+}
+
+void NativeLibraryIndex::rebuild(NativeCodeCache** libs, int lib_count) {
+    // Odd version means the update is in progress; it also serves as a writer lock
+    unsigned int version;
+    while ((version = _version) & 1 || !__sync_bool_compare_and_swap(&_version, version, version + 1)) {
+        spinPause();
+    }
+
+    int count = 0;
+    for (int i = 0; i < lib_count && count < _capacity; i++) {
+        // Libraries without symbols may have no bounds
+        if (libs[i]->minAddress() < libs[i]->maxAddress()) {
+            _ranges[count].start = libs[i]->minAddress();
+            _ranges[count].end = libs[i]->maxAddress();
+            _ranges[count].lib = libs[i];
+            count++;
         }
     }
-    return NULL;
+    qsort(_ranges, count, sizeof(LibraryRange), compareRanges);
+
+    _count = count;
+    _indexed_libs = lib_count;
+    __sync_fetch_and_add(&_version, 1);
+}
+
+int NativeLibraryIndex::find(const void* address, NativeCodeCache** lib) {
+    unsigned int version = _version;
+    if (version & 1) {
+        return -1;
+    }
+    __sync_synchronize();
+
+    int indexed_libs = _indexed_libs;
+    int low = 0;
+    int high = _count - 1;
+
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (_ranges[mid].start <= address) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    *lib = high >= 0 && address < _ranges[high].end ? _ranges[high].lib : NULL;
+
+    __sync_synchronize();
+    return _version == version ? indexed_libs : -1;
 }
@@ -18,12 +18,15 @@
 #define _CODECACHE_H
 
 #include <jvmti.h>
+#include "dwarf.h"
+#include "memoryUsage.h"
 
 
 #define NO_MIN_ADDRESS  ((const void*)-1)
 #define NO_MAX_ADDRESS  ((const void*)0)
 
 const int INITIAL_CODE_CACHE_CAPACITY = 1000;
+const int MAX_UNSORTED_BLOBS = 256;
 
 
 class CodeBlob {
@@ -48,47 +51,89 @@ class CodeBlob {
 };
 
 
+// Blobs of a CodeCache preceded by a header. Signal handlers look up the array without locking,
+// so a published array never changes in place except for appending past _count
+// and clearing _method of a removed blob. Everything else builds a new array.
+class CodeBlobArray {
+  public:
+    CodeBlobArray* _next_retired;
+    int _capacity;
+    int _sorted;  // blobs [0, _sorted) are ordered by address, the rest are not
+    volatile int _count;
+
+    static CodeBlobArray* allocate(int capacity);
+    static void destroy(CodeBlobArray* array);
+
+    CodeBlob* blobs() {
+        return (CodeBlob*)(this + 1);
+    }
+};
+
+
 class CodeCache {
   protected:
-    int _capacity;
-    int _count;
-    CodeBlob* _blobs;
+    CodeBlobArray* volatile _array;
+    CodeBlobArray* _retired;
     const void* _min_address;
     const void* _max_address;
 
+    void publish(CodeBlobArray* array);
     void expand();
+    void append(const void* start, const void* end, jmethodID method);
+    void sortBlobs();
 
   public:
-    CodeCache() {
-        _capacity = INITIAL_CODE_CACHE_CAPACITY;
-        _count = 0;
-        _blobs = new CodeBlob[_capacity];
-        _min_address = NO_MIN_ADDRESS;
-        _max_address = NO_MAX_ADDRESS;
-    }
+    CodeCache();
+    ~CodeCache();
+
+    void reset();
 
-    ~CodeCache() {
-        delete[] _blobs;
+    bool contains(const void* address) {
+        return address >= _min_address && address < _max_address;
     }
 
-    void reset() {
-        _count = 0;
+    int count() {
+        return _array->_count;
     }
 
-    bool contains(const void* address) {
-        return address >= _min_address && address < _max_address;
+    const CodeBlob* blobs() {
+        return _array->blobs();
     }
 
     void add(const void* start, int length, jmethodID method, bool update_bounds = false);
     void remove(const void* start, jmethodID method);
     void updateBounds(const void* start, const void* end);
     jmethodID find(const void* address);
+
+    // Arrays replaced since the last call. Writers detach them under their lock;
+    // they may be freed only when no concurrent find() can still be using them
+    CodeBlobArray* detachRetired();
+    static void freeArrays(CodeBlobArray* list);
 };
 
 
 class NativeCodeCache : public CodeCache {
   private:
     char* _name;
+    int* volatile _name_index;  // blob indices ordered by name, built on first lookup by name
+    char* _lazy_file;           // the file to load symbols from on first use; NULL if already loaded
+    const char* _lazy_base;
+    volatile bool _symbols_requested;
+    const char* _symbol_image;  // mapped symbol index; names inside it are not owned by the cache
+    size_t _symbol_image_size;
+    const char* _image_base;    // address of the ELF header in memory, if it is known to be mapped
+    const void* _image_end;     // end of the last mapping of the library file, including data
+    FrameDesc* _dwarf_table;
+    volatile int _dwarf_table_length;
+    bool _dwarf_parsed;
+
+    int* nameIndex();
+    void invalidateNameIndex();
+    int findByName(const char* name, size_t len, bool exact);
+
+    bool ownsName(const char* name) {
+        return name < _symbol_image || name >= _symbol_image + _symbol_image_size;
+    }
 
   public:
     NativeCodeCache(const char* name,
@@ -109,12 +154,93 @@ class NativeCodeCache : public CodeCache {
         return _max_address;
     }
 
+    bool symbolsLoaded() {
+        return _lazy_file == NULL;
+    }
+
+    // True if a sample has hit the library before its symbols have been loaded
+    bool symbolsRequested() {
+        return _symbols_requested;
+    }
+
+    const char* lazyFile() {
+        return _lazy_file;
+    }
+
+    const char* lazyBase() {
+        return _lazy_base;
+    }
+
+    const char* imageBase() {
+        return _image_base;
+    }
+
+    void setImageBase(const char* base) {
+        _image_base = base;
+    }
+
+    void setImageEnd(const void* end) {
+        _image_end = end;
+    }
+
+    // Whether the address belongs to any mapping of the library file, not only to its code
+    bool containsImage(const void* address) {
+        const void* start = _image_base != NULL ? _image_base : _min_address;
+        const void* end = _image_end > _max_address ? _image_end : _max_address;
+        return address >= start && address < end;
+    }
+
+    bool dwarfParsed() {
+        return _dwarf_parsed;
+    }
+
+    void setLazy(const char* file, const char* base);
+    void adoptSymbols(NativeCodeCache* other);
+
     void add(const void* start, int length, const char* name, bool update_bounds = false);
     void sort();
+
+    // Takes ownership of a mapped image of symbol names, so that addMapped() can refer to names inside it
+    bool attachSymbolImage(const void* image, size_t size);
+    void addMapped(const void* start, int length, const char* name);
+
+    // The table may be set once, while signal handlers are already looking up the library
+    void setDwarfTable(FrameDesc* table, int length);
+    FrameDesc* findFrameDesc(const void* pc);
+
     const char* binarySearch(const void* address);
     const void* findSymbol(const char* name);
     const void* findSymbolByPrefix(const char* prefix);
     const void* findSymbolByPrefix(const char* prefix, int prefix_len);
 };
 
+
+struct LibraryRange {
+    const void* start;
+    const void* end;
+    NativeCodeCache* lib;
+};
+
+// Address ranges of native libraries sorted for binary search.
+// Rebuilt as a whole when new libraries are loaded. Readers may run in a signal handler,
+// so instead of locking they check a sequence counter and report a concurrent update.
+class NativeLibraryIndex {
+  private:
+    LibraryRange* _ranges;
+    int _capacity;
+    int _count;
+    int _indexed_libs;
+    volatile unsigned int _version;
+
+  public:
+    NativeLibraryIndex(int capacity);
+    ~NativeLibraryIndex();
+
+    void rebuild(NativeCodeCache** libs, int lib_count);
+
+    // Returns how many libraries, counting from the first, the index covers,
+    // or -1 if the index is being updated. *lib is set to the library containing the address or NULL
+    int find(const void* address, NativeCodeCache** lib);
+};
+
 #endif // _CODECACHE_H
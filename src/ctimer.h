@@ -0,0 +1,52 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CTIMER_H
+#define _CTIMER_H
+
+#include <signal.h>
+#include "engine.h"
+
+
+// CPU profiling with a per-thread timer on the thread CPU-time clock.
+// Unlike ITimer, every thread is sampled proportionally to its own CPU time;
+// unlike PerfEvents, no perf_events permissions are needed.
+class CTimer : public Engine {
+  private:
+    static long _interval;
+    static int _max_timers;
+    static int* _timers;
+
+    static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
+
+  public:
+    const char* title() {
+        return "CPU profile";
+    }
+
+    const char* units() {
+        return "ns";
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    static int createForThread(int tid);
+    static void destroyForThread(int tid);
+};
+
+#endif // _CTIMER_H
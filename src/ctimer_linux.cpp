@@ -0,0 +1,164 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "ctimer.h"
+#include "log.h"
+#include "os.h"
+#include "profiler.h"
+
+
+#ifndef SIGEV_THREAD_ID
+#define SIGEV_THREAD_ID  4
+#endif
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id  _sigev_un._tid
+#endif
+
+// CPU-time clock of an arbitrary thread of the current process, see MAKE_THREAD_CPUCLOCK in the kernel
+static inline clockid_t threadCpuClock(int tid) {
+    return ((~(clockid_t)tid) << 3) | 6;  // CPUCLOCK_PERTHREAD_MASK | CPUCLOCK_SCHED
+}
+
+
+long CTimer::_interval;
+int CTimer::_max_timers = 0;
+int* CTimer::_timers = NULL;
+
+
+// Timers are created with raw syscalls: kernel timer IDs are plain ints,
+// and glibc does not need to track timers that deliver signals to a thread.
+// IDs are stored incremented by one, so that zero means no timer.
+int CTimer::createForThread(int tid) {
+    if (tid >= _max_timers) {
+        Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_timers);
+        return -1;
+    }
+
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_notify_thread_id = tid;
+
+    int timer = 0;
+    if (syscall(__NR_timer_create, threadCpuClock(tid), &sev, &timer) != 0) {
+        int err = errno;
+        // The thread may have exited already
+        if (err != ESRCH && err != EINVAL) {
+            Log::warn("timer_create failed: %s", strerror(err));
+        }
+        return err;
+    }
+
+    if (!__sync_bool_compare_and_swap(&_timers[tid], 0, timer + 1)) {
+        // Lost race. The timer is created either from start() or from onThreadStart()
+        syscall(__NR_timer_delete, timer);
+        return -1;
+    }
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = spec.it_value.tv_sec = _interval / 1000000000;
+    spec.it_interval.tv_nsec = spec.it_value.tv_nsec = _interval % 1000000000;
+    syscall(__NR_timer_settime, timer, 0, &spec, NULL);
+
+    return 0;
+}
+
+void CTimer::destroyForThread(int tid) {
+    if (tid >= _max_timers) {
+        return;
+    }
+
+    int timer = _timers[tid];
+    if (timer != 0 && __sync_bool_compare_and_swap(&_timers[tid], timer, 0)) {
+        syscall(__NR_timer_delete, timer - 1);
+    }
+}
+
+void CTimer::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    if (!_enabled) return;
+
+    ExecutionEvent event;
+    Profiler::instance()->recordSample(ucontext, _interval, 0, &event);
+}
+
+Error CTimer::check(Arguments& args) {
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_notify_thread_id = OS::threadId();
+
+    int timer;
+    if (syscall(__NR_timer_create, CLOCK_THREAD_CPUTIME_ID, &sev, &timer) != 0) {
+        return Error("Failed to create CPU timer");
+    }
+    syscall(__NR_timer_delete, timer);
+
+    return Error::OK;
+}
+
+Error CTimer::start(Arguments& args) {
+    if (args._interval < 0) {
+        return Error("interval must be positive");
+    }
+    _interval = args._interval ? args._interval : DEFAULT_INTERVAL;
+
+    int max_timers = OS::getMaxThreadId();
+    if (max_timers != _max_timers) {
+        free(_timers);
+        _timers = (int*)calloc(max_timers, sizeof(int));
+        _max_timers = max_timers;
+    }
+
+    OS::installSignalHandler(SIGPROF, signalHandler);
+
+    // Enable thread events before traversing currently running threads
+    Profiler::instance()->switchThreadEvents(JVMTI_ENABLE);
+
+    // Create timers for all existing threads
+    bool created = false;
+    ThreadList* thread_list = OS::listThreads();
+    for (int tid; (tid = thread_list->next()) != -1; ) {
+        if (createForThread(tid) == 0) {
+            created = true;
+        }
+    }
+    delete thread_list;
+
+    if (!created) {
+        Profiler::instance()->switchThreadEvents(JVMTI_DISABLE);
+        return Error("Failed to create CPU timers");
+    }
+    return Error::OK;
+}
+
+void CTimer::stop() {
+    for (int i = 0; i < _max_timers; i++) {
+        destroyForThread(i);
+    }
+}
+
+#endif // __linux__
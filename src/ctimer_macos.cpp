@@ -0,0 +1,48 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef __APPLE__
+
+#include "ctimer.h"
+
+
+long CTimer::_interval;
+int CTimer::_max_timers;
+int* CTimer::_timers;
+
+
+void CTimer::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+}
+
+Error CTimer::check(Arguments& args) {
+    return Error("CTimer is unsupported on macOS");
+}
+
+Error CTimer::start(Arguments& args) {
+    return Error("CTimer is unsupported on macOS");
+}
+
+void CTimer::stop() {
+}
+
+int CTimer::createForThread(int tid) {
+    return -1;
+}
+
+void CTimer::destroyForThread(int tid) {
+}
+
+#endif // __APPLE__
@@ -14,61 +14,140 @@
  * limitations under the License.
  */
 
-#include <stdlib.h>
 #include <string.h>
 #include "dictionary.h"
-#include "arch.h"
+#include "memoryUsage.h"
+#include "os.h"
 
 
-static inline char* allocateKey(const char* key, size_t length) {
-    char* result = (char*)malloc(length + 1);
-    memcpy(result, key, length);
-    result[length] = 0;
-    return result;
-}
-
-static inline bool keyEquals(const char* candidate, const char* key, size_t length) {
-    return strncmp(candidate, key, length) == 0 && candidate[length] == 0;
+static inline bool keyEquals(const DictKey* candidate, const char* key, size_t length, u32 hash) {
+    return candidate->hash == hash && candidate->length == length && memcmp(candidate->str, key, length) == 0;
 }
 
 
-Dictionary::Dictionary() {
-    _table = (DictTable*)calloc(1, sizeof(DictTable));
-    _table->base_index = _base_index = 1;
+Dictionary::Dictionary() : _arena(DICT_CHUNK_SIZE, MEM_DICTIONARIES) {
+    _large_keys = NULL;
+    _base_index = 1;
+    _table = allocateTable(NULL, INITIAL_DICT_CAPACITY);
 }
 
 Dictionary::~Dictionary() {
-    clear(_table);
-    free(_table);
+    freeTables(_table);
+    freeLargeKeys();
 }
 
 void Dictionary::clear() {
-    clear(_table);
-    memset(_table, 0, sizeof(DictTable));
-    _table->base_index = _base_index = 1;
+    freeTables(_table);
+    freeLargeKeys();
+    _arena.clear();
+    _base_index = 1;
+    _table = allocateTable(NULL, INITIAL_DICT_CAPACITY);
 }
 
-void Dictionary::clear(DictTable* table) {
-    for (int i = 0; i < ROWS; i++) {
-        DictRow* row = &table->rows[i];
-        for (int j = 0; j < CELLS; j++) {
-            free(row->keys[j]);
-        }
-        if (row->next != NULL) {
-            clear(row->next);
-            free(row->next);
+DictTable* Dictionary::allocateTable(DictTable* prev, u32 capacity) {
+    size_t size = sizeof(DictTable) + capacity * sizeof(DictKey*);
+    DictTable* table = (DictTable*)OS::safeAlloc(size);
+    if (table != NULL) {
+        MemoryUsage::allocate(MEM_DICTIONARIES, size);
+        table->prev = prev;
+        table->capacity = capacity;
+        table->base_index = __sync_fetch_and_add(&_base_index, capacity);
+        table->size = 0;
+    }
+    return table;
+}
+
+void Dictionary::freeTables(DictTable* table) {
+    while (table != NULL) {
+        DictTable* prev = table->prev;
+        size_t size = sizeof(DictTable) + table->capacity * sizeof(DictKey*);
+        MemoryUsage::release(MEM_DICTIONARIES, size);
+        OS::safeFree(table, size);
+        table = prev;
+    }
+}
+
+void Dictionary::grow(DictTable* table) {
+    if (_table != table) {
+        return;  // someone has already grown it
+    }
+
+    DictTable* new_table = allocateTable(table, table->capacity * 2);
+    if (new_table != NULL && !__sync_bool_compare_and_swap(&_table, table, new_table)) {
+        // Lost the race; the reserved range of indices is simply skipped
+        new_table->prev = NULL;
+        freeTables(new_table);
+    }
+}
+
+DictKey* Dictionary::allocateKey(const char* key, size_t length, u32 hash) {
+    DictKey* result = length <= MAX_ARENA_KEY_LENGTH
+        ? (DictKey*)_arena.alloc((sizeof(DictKey) + length + 3) & ~3)
+        : allocateLargeKey(length);
+    if (result != NULL) {
+        result->hash = hash;
+        result->length = length;
+        memcpy(result->str, key, length);
+        result->str[length] = 0;
+    }
+    return result;
+}
+
+// A key that does not fit in an arena chunk gets its own mapping, freed together with the arena
+DictKey* Dictionary::allocateLargeKey(size_t length) {
+    size_t size = sizeof(LargeDictKey) + length;
+    LargeDictKey* large_key = (LargeDictKey*)OS::safeAlloc(size);
+    if (large_key == NULL) {
+        return NULL;
+    }
+    MemoryUsage::allocate(MEM_DICTIONARIES, size);
+    large_key->size = size;
+
+    LargeDictKey* head;
+    do {
+        head = _large_keys;
+        large_key->next = head;
+    } while (!__sync_bool_compare_and_swap(&_large_keys, head, large_key));
+
+    return &large_key->key;
+}
+
+void Dictionary::freeLargeKeys() {
+    LargeDictKey* large_key = _large_keys;
+    while (large_key != NULL) {
+        LargeDictKey* next = large_key->next;
+        MemoryUsage::release(MEM_DICTIONARIES, large_key->size);
+        OS::safeFree(large_key, large_key->size);
+        large_key = next;
+    }
+    _large_keys = NULL;
+}
+
+// Searches tables starting from the given one, down to the oldest
+DictKey* Dictionary::findKey(DictTable* table, const char* key, size_t length, u32 hash) {
+    for (; table != NULL; table = table->prev) {
+        DictKey* volatile* keys = table->keys();
+        u32 mask = table->capacity - 1;
+        for (u32 slot = hash & mask, step = 0; step <= mask; slot = (slot + 1) & mask, step++) {
+            DictKey* k = keys[slot];
+            if (k == NULL) {
+                break;
+            } else if (keyEquals(k, key, length, hash)) {
+                return k;
+            }
         }
     }
+    return NULL;
 }
 
 // Many popular symbols are quite short, e.g. "[B", "()V" etc.
 // FNV-1a is reasonably fast and sufficiently random.
-unsigned int Dictionary::hash(const char* key, size_t length) {
-    unsigned int h = 2166136261U;
+u32 Dictionary::hash(const char* key, size_t length) {
+    u32 h = 2166136261U;
     for (size_t i = 0; i < length; i++) {
         h = (h ^ key[i]) * 16777619;
     }
-    return h;
+    return h ^ (h >> 15);
 }
 
 unsigned int Dictionary::lookup(const char* key) {
@@ -76,51 +155,76 @@ unsigned int Dictionary::lookup(const char* key) {
 }
 
 unsigned int Dictionary::lookup(const char* key, size_t length) {
-    DictTable* table = _table;
-    unsigned int h = hash(key, length);
+    u32 h = hash(key, length);
+    DictKey* new_key = NULL;
+    bool migrated = false;
 
     while (true) {
-        DictRow* row = &table->rows[h % ROWS];
-        for (int c = 0; c < CELLS; c++) {
-            if (row->keys[c] == NULL) {
-                char* new_key = allocateKey(key, length);
-                if (__sync_bool_compare_and_swap(&row->keys[c], NULL, new_key)) {
-                    return table->index(h % ROWS, c);
+        DictTable* table = _table;
+        DictKey* volatile* keys = table->keys();
+        u32 mask = table->capacity - 1;
+        bool retry = false;
+
+        for (u32 slot = h & mask, step = 0; step <= mask; slot = (slot + 1) & mask, step++) {
+            DictKey* k = keys[slot];
+            if (k == NULL) {
+                if (new_key == NULL) {
+                    // The key may have been added before the table has grown
+                    new_key = findKey(table->prev, key, length, h);
+                    migrated = new_key != NULL;
+                    if (!migrated && (new_key = allocateKey(key, length, h)) == NULL) {
+                        return 0;
+                    }
                 }
-                free(new_key);
+
+                // Fresh keys are not visible to others yet, so their id can be freely reassigned
+                if (!migrated) {
+                    new_key->id = table->base_index + slot;
+                }
+
+                if (__sync_bool_compare_and_swap(&keys[slot], NULL, new_key)) {
+                    if (__sync_add_and_fetch(&table->size, 1) * 4 >= table->capacity * 3) {
+                        grow(table);
+                    }
+                    if (migrated || _table == table) {
+                        return new_key->id;
+                    }
+                    // A fresh key went to the table that has just been replaced.
+                    // Another thread could have missed it and put a duplicate to the new table,
+                    // so repeat the lookup there to agree on a single id.
+                    new_key = NULL;
+                    retry = true;
+                    break;
+                }
+                k = keys[slot];
             }
-            if (keyEquals(row->keys[c], key, length)) {
-                return table->index(h % ROWS, c);
+
+            if (keyEquals(k, key, length, h)) {
+                return k->id;
             }
         }
 
-        if (row->next == NULL) {
-            DictTable* new_table = (DictTable*)calloc(1, sizeof(DictTable));
-            new_table->base_index = __sync_add_and_fetch(&_base_index, TABLE_CAPACITY);
-            if (!__sync_bool_compare_and_swap(&row->next, NULL, new_table)) {
-                free(new_table);
-            }
+        if (retry) {
+            continue;
         }
 
-        table = row->next;
-        h = (h >> ROW_BITS) | (h << (32 - ROW_BITS));
+        // The table is full, which may happen only if it failed to grow in time
+        grow(table);
+        if (_table == table) {
+            return 0;
+        }
     }
 }
 
 void Dictionary::collect(std::map<unsigned int, const char*>& map) {
-    collect(map, _table);
-}
-
-void Dictionary::collect(std::map<unsigned int, const char*>& map, DictTable* table) {
-    for (int i = 0; i < ROWS; i++) {
-        DictRow* row = &table->rows[i];
-        for (int j = 0; j < CELLS; j++) {
-            if (row->keys[j] != NULL) {
-                map[table->index(i, j)] = row->keys[j];
+    // Moved keys appear in several tables under the same id
+    for (DictTable* table = _table; table != NULL; table = table->prev) {
+        DictKey* volatile* keys = table->keys();
+        for (u32 slot = 0; slot < table->capacity; slot++) {
+            DictKey* k = keys[slot];
+            if (k != NULL) {
+                map[k->id] = k->str;
             }
         }
-        if (row->next != NULL) {
-            collect(map, row->next);
-        }
     }
 }
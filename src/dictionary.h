@@ -19,41 +19,61 @@
 
 #include <map>
 #include <stddef.h>
+#include "arch.h"
+#include "linearAllocator.h"
 
 
-#define ROW_BITS        7
-#define ROWS            (1 << ROW_BITS)
-#define CELLS           3
-#define TABLE_CAPACITY  (ROWS * CELLS)
+const u32 INITIAL_DICT_CAPACITY = 1024;
+const size_t DICT_CHUNK_SIZE = 64 * 1024;
+// Longer keys are allocated separately rather than in the arena
+const size_t MAX_ARENA_KEY_LENGTH = DICT_CHUNK_SIZE / 4;
 
 
-struct DictTable;
+// Immutable once published: a key never moves, so its id is stable
+struct DictKey {
+    u32 hash;
+    u32 id;
+    u32 length;
+    char str[1];
+};
 
-struct DictRow {
-    char* keys[CELLS];
-    DictTable* next;
+struct LargeDictKey {
+    LargeDictKey* next;
+    size_t size;
+    DictKey key;
 };
 
 struct DictTable {
-    DictRow rows[ROWS];
-    unsigned int base_index;
+    DictTable* prev;
+    u32 capacity;
+    u32 base_index;
+    volatile u32 size;
 
-    unsigned int index(int row, int col) {
-        return base_index + (col << ROW_BITS) + row;
+    DictKey* volatile* keys() {
+        return (DictKey* volatile*)(this + 1);
     }
 };
 
-// Append-only concurrent hash table based on multi-level arrays
+// Append-only concurrent hash table with open addressing.
+// When a table becomes 3/4 full, a twice larger one is installed on top of it;
+// keys from older tables are moved to the current one lazily upon lookup.
 class Dictionary {
   private:
-    DictTable* _table;
+    LinearAllocator _arena;
+    LargeDictKey* volatile _large_keys;
+    DictTable* volatile _table;
     volatile unsigned int _base_index;
 
-    static void clear(DictTable* table);
+    DictTable* allocateTable(DictTable* prev, u32 capacity);
+    void freeTables(DictTable* table);
+    void grow(DictTable* table);
+    DictKey* allocateKey(const char* key, size_t length, u32 hash);
+    DictKey* allocateLargeKey(size_t length);
+    void freeLargeKeys();
 
-    static unsigned int hash(const char* key, size_t length);
+    static DictKey* findKey(DictTable* table, const char* key, size_t length, u32 hash);
 
-    static void collect(std::map<unsigned int, const char*>& map, DictTable* table);
+    static u32 hash(const char* key, size_t length);
 
   public:
     Dictionary();
@@ -0,0 +1,462 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "dwarf.h"
+#include "log.h"
+
+
+enum {
+    DW_CFA_nop                 = 0x0,
+    DW_CFA_set_loc             = 0x1,
+    DW_CFA_advance_loc1        = 0x2,
+    DW_CFA_advance_loc2        = 0x3,
+    DW_CFA_advance_loc4        = 0x4,
+    DW_CFA_offset_extended     = 0x5,
+    DW_CFA_restore_extended    = 0x6,
+    DW_CFA_undefined           = 0x7,
+    DW_CFA_same_value          = 0x8,
+    DW_CFA_register            = 0x9,
+    DW_CFA_remember_state      = 0xa,
+    DW_CFA_restore_state       = 0xb,
+    DW_CFA_def_cfa             = 0xc,
+    DW_CFA_def_cfa_register    = 0xd,
+    DW_CFA_def_cfa_offset      = 0xe,
+    DW_CFA_def_cfa_expression  = 0xf,
+    DW_CFA_expression          = 0x10,
+    DW_CFA_offset_extended_sf  = 0x11,
+    DW_CFA_def_cfa_sf          = 0x12,
+    DW_CFA_def_cfa_offset_sf   = 0x13,
+    DW_CFA_val_offset          = 0x14,
+    DW_CFA_val_offset_sf       = 0x15,
+    DW_CFA_val_expression      = 0x16,
+    DW_CFA_GNU_window_save     = 0x2d,
+    DW_CFA_GNU_args_size       = 0x2e,
+    DW_CFA_GNU_negative_offset_extended = 0x2f,
+
+    DW_CFA_advance_loc         = 0x1,
+    DW_CFA_offset              = 0x2,
+    DW_CFA_restore             = 0x3
+};
+
+enum {
+    DW_OP_breg_pc = 0x70 + DW_REG_PC,
+    DW_OP_breg_sp = 0x70 + DW_REG_SP
+};
+
+enum {
+    DW_EH_PE_absptr  = 0x00,
+    DW_EH_PE_uleb128 = 0x01,
+    DW_EH_PE_udata2  = 0x02,
+    DW_EH_PE_udata4  = 0x03,
+    DW_EH_PE_udata8  = 0x04,
+    DW_EH_PE_sleb128 = 0x09,
+    DW_EH_PE_sdata2  = 0x0a,
+    DW_EH_PE_sdata4  = 0x0b,
+    DW_EH_PE_sdata8  = 0x0c,
+    DW_EH_PE_pcrel   = 0x10,
+    DW_EH_PE_datarel = 0x30,
+    DW_EH_PE_omit    = 0xff
+};
+
+const int INITIAL_TABLE_CAPACITY = 1024;
+const int MAX_REMEMBERED_STATES = 16;
+
+
+// Code without CFI is assumed to maintain the frame pointer chain
+FrameDesc FrameDesc::default_frame = {0, DW_REG_FP | LINKED_FRAME_SIZE << 8, -LINKED_FRAME_SIZE};
+
+int FrameDesc::comparator(const void* p1, const void* p2) {
+    const FrameDesc* fd1 = (const FrameDesc*)p1;
+    const FrameDesc* fd2 = (const FrameDesc*)p2;
+    return fd1->loc == fd2->loc ? 0 : fd1->loc < fd2->loc ? -1 : 1;
+}
+
+
+DwarfParser::DwarfParser(const char* name, const char* image_base, const char* eh_frame_hdr) {
+    _name = name;
+    _image_base = image_base;
+
+    _capacity = INITIAL_TABLE_CAPACITY;
+    _count = 0;
+    _table = (FrameDesc*)malloc(_capacity * sizeof(FrameDesc));
+
+    if (_table != NULL) {
+        parse(eh_frame_hdr);
+    }
+}
+
+u64 DwarfParser::getEncoded(u8 encoding) {
+    switch (encoding & 0x0f) {
+        case DW_EH_PE_uleb128:
+            return getLeb();
+        case DW_EH_PE_udata2:
+            return get16();
+        case DW_EH_PE_udata4:
+            return get32();
+        case DW_EH_PE_sleb128:
+            return (u64)(long long)getSLeb();
+        case DW_EH_PE_sdata2:
+            return (u64)(long long)(short)get16();
+        case DW_EH_PE_sdata4:
+            return (u64)(long long)(int)get32();
+        default:
+            return get64();
+    }
+}
+
+const char* DwarfParser::getPtr(u8 encoding) {
+    const char* ptr = _ptr;
+    u64 value = getEncoded(encoding);
+    return (encoding & 0x70) == DW_EH_PE_pcrel ? ptr + value : (const char*)value;
+}
+
+void DwarfParser::parse(const char* eh_frame_hdr) {
+    u8 version = eh_frame_hdr[0];
+    u8 eh_frame_ptr_enc = eh_frame_hdr[1];
+    u8 fde_count_enc = eh_frame_hdr[2];
+    u8 table_enc = eh_frame_hdr[3];
+
+    // The binary search table is what linkers always generate; other layouts are not worth supporting
+    if (version != 1 || eh_frame_ptr_enc == DW_EH_PE_omit || fde_count_enc == DW_EH_PE_omit
+        || table_enc != (DW_EH_PE_datarel | DW_EH_PE_sdata4)) {
+        return;
+    }
+
+    _ptr = eh_frame_hdr + 4;
+    getPtr(eh_frame_ptr_enc);
+    u32 fde_count = (u32)getEncoded(fde_count_enc);
+
+    const int* table = (const int*)_ptr;
+    const char* cie = NULL;
+    bool sorted = true;
+
+    for (u32 i = 0; i < fde_count; i++) {
+        const char* fde = eh_frame_hdr + table[i * 2 + 1];
+        u32 loc = (u32)(eh_frame_hdr + table[i * 2] - _image_base);
+
+        _ptr = fde;
+        u32 length = get32();
+        if (length == 0 || length == 0xffffffff) {
+            continue;
+        }
+
+        // CIE pointer is relative to its own position
+        const char* fde_cie = _ptr - get32();
+        if (fde_cie != cie) {
+            if (!parseCie(fde_cie)) {
+                continue;
+            }
+            cie = fde_cie;
+        }
+
+        if (_count > 0 && loc < _table[_count - 1].loc) {
+            sorted = false;
+        }
+        parseFde(fde, loc);
+
+        if (_table == NULL) {
+            Log::warn("Not enough memory for unwind table of %s", _name);
+            return;
+        }
+    }
+
+    if (!sorted) {
+        qsort(_table, _count, sizeof(FrameDesc), FrameDesc::comparator);
+    }
+
+    // The table lives as long as the library, so do not waste the spare capacity
+    if (_count == 0) {
+        free(_table);
+        _table = NULL;
+    } else if (_count < _capacity) {
+        FrameDesc* table = (FrameDesc*)realloc(_table, _count * sizeof(FrameDesc));
+        if (table != NULL) {
+            _table = table;
+            _capacity = _count;
+        }
+    }
+}
+
+bool DwarfParser::parseCie(const char* cie) {
+    _ptr = cie;
+    u32 length = get32();
+    if (length == 0 || length == 0xffffffff) {
+        return false;
+    }
+    _cie_end = cie + 4 + length;
+
+    if (get32() != 0) {
+        return false;  // not a CIE
+    }
+
+    u8 version = get8();
+    const char* augmentation = _ptr;
+    _ptr += strlen(augmentation) + 1;
+
+    _code_align = getLeb();
+    _data_align = getSLeb();
+    if (version == 1) {
+        get8();
+    } else {
+        getLeb();
+    }
+
+    _fde_encoding = DW_EH_PE_absptr;
+    _fde_augmentation = false;
+
+    if (augmentation[0] == 'z') {
+        u32 augmentation_length = getLeb();
+        const char* augmentation_end = _ptr + augmentation_length;
+        for (const char* a = augmentation + 1; *a != 0; a++) {
+            if (*a == 'R') {
+                _fde_encoding = get8();
+            } else if (*a == 'P') {
+                getPtr(get8());
+            } else if (*a == 'L') {
+                get8();
+            } else if (*a != 'S' && *a != 'B') {
+                break;  // the rest is skipped by the augmentation length
+            }
+        }
+        _ptr = augmentation_end;
+        _fde_augmentation = true;
+    } else if (augmentation[0] != 0) {
+        return false;
+    }
+
+    _cie_instructions = _ptr;
+    return true;
+}
+
+void DwarfParser::parseFde(const char* fde, u32 loc) {
+    // Initial rules of the CIE apply to every FDE
+    int cfa_reg = DW_REG_SP;
+    int cfa_off = EMPTY_FRAME_SIZE;
+    int fp_off = DW_SAME_FP;
+    _ptr = _cie_instructions;
+    parseInstructions(loc, _cie_end, cfa_reg, cfa_off, fp_off, true);
+    _initial_fp_off = fp_off;
+
+    _ptr = fde;
+    const char* fde_end = fde + 4 + get32();
+    get32();
+
+    // The start address is taken from .eh_frame_hdr, only the size is needed here
+    getEncoded(_fde_encoding);
+    u32 range = (u32)getEncoded(_fde_encoding & 0x0f);
+    if (_fde_augmentation) {
+        _ptr += getLeb();
+    }
+
+    parseInstructions(loc, fde_end, cfa_reg, cfa_off, fp_off, false);
+
+    // Addresses past the function are not covered by this FDE
+    const FrameDesc& def = FrameDesc::default_frame;
+    addRecord(loc + range, def.cfaReg(), def.cfaOff(), def.fp_off);
+}
+
+void DwarfParser::parseInstructions(u32 loc, const char* end, int& cfa_reg, int& cfa_off, int& fp_off, bool cie) {
+    int remembered[MAX_REMEMBERED_STATES][3];
+    int remembered_count = 0;
+
+    while (_ptr < end) {
+        u8 op = get8();
+        switch (op >> 6) {
+            case 0:
+                break;
+            case DW_CFA_advance_loc:
+                if (!cie) addRecord(loc, cfa_reg, cfa_off, fp_off);
+                loc += (op & 0x3f) * _code_align;
+                continue;
+            case DW_CFA_offset: {
+                int offset = (int)getLeb() * _data_align;
+                if ((op & 0x3f) == DW_REG_FP) fp_off = offset;
+                continue;
+            }
+            case DW_CFA_restore:
+                if ((op & 0x3f) == DW_REG_FP) fp_off = _initial_fp_off;
+                continue;
+        }
+
+        switch (op) {
+            case DW_CFA_nop:
+            case DW_CFA_GNU_window_save:
+                break;
+            case DW_CFA_set_loc:
+                if (!cie) addRecord(loc, cfa_reg, cfa_off, fp_off);
+                loc = (u32)(getPtr(_fde_encoding) - _image_base);
+                break;
+            case DW_CFA_advance_loc1:
+                if (!cie) addRecord(loc, cfa_reg, cfa_off, fp_off);
+                loc += get8() * _code_align;
+                break;
+            case DW_CFA_advance_loc2:
+                if (!cie) addRecord(loc, cfa_reg, cfa_off, fp_off);
+                loc += get16() * _code_align;
+                break;
+            case DW_CFA_advance_loc4:
+                if (!cie) addRecord(loc, cfa_reg, cfa_off, fp_off);
+                loc += get32() * _code_align;
+                break;
+            case DW_CFA_offset_extended: {
+                u32 reg = getLeb();
+                int offset = (int)getLeb() * _data_align;
+                if (reg == DW_REG_FP) fp_off = offset;
+                break;
+            }
+            case DW_CFA_offset_extended_sf: {
+                u32 reg = getLeb();
+                int offset = getSLeb() * _data_align;
+                if (reg == DW_REG_FP) fp_off = offset;
+                break;
+            }
+            case DW_CFA_GNU_negative_offset_extended: {
+                u32 reg = getLeb();
+                int offset = -(int)getLeb() * _data_align;
+                if (reg == DW_REG_FP) fp_off = offset;
+                break;
+            }
+            case DW_CFA_restore_extended:
+                if (getLeb() == DW_REG_FP) fp_off = _initial_fp_off;
+                break;
+            case DW_CFA_undefined:
+            case DW_CFA_same_value:
+                if (getLeb() == DW_REG_FP) fp_off = DW_SAME_FP;
+                break;
+            case DW_CFA_register:
+                if (getLeb() == DW_REG_FP) fp_off = DW_SAME_FP;
+                getLeb();
+                break;
+            case DW_CFA_remember_state:
+                if (remembered_count < MAX_REMEMBERED_STATES) {
+                    remembered[remembered_count][0] = cfa_reg;
+                    remembered[remembered_count][1] = cfa_off;
+                    remembered[remembered_count][2] = fp_off;
+                    remembered_count++;
+                }
+                break;
+            case DW_CFA_restore_state:
+                if (remembered_count > 0) {
+                    remembered_count--;
+                    cfa_reg = remembered[remembered_count][0];
+                    cfa_off = remembered[remembered_count][1];
+                    fp_off = remembered[remembered_count][2];
+                }
+                break;
+            case DW_CFA_def_cfa:
+                cfa_reg = getLeb();
+                cfa_off = getLeb();
+                break;
+            case DW_CFA_def_cfa_sf:
+                cfa_reg = getLeb();
+                cfa_off = getSLeb() * _data_align;
+                break;
+            case DW_CFA_def_cfa_register:
+                cfa_reg = getLeb();
+                break;
+            case DW_CFA_def_cfa_offset:
+                cfa_off = getLeb();
+                break;
+            case DW_CFA_def_cfa_offset_sf:
+                cfa_off = getSLeb() * _data_align;
+                break;
+            case DW_CFA_def_cfa_expression: {
+                u32 length = getLeb();
+                const char* expression_end = _ptr + length;
+                cfa_reg = parseExpression(length, cfa_off);
+                _ptr = expression_end;
+                break;
+            }
+            case DW_CFA_expression:
+            case DW_CFA_val_expression:
+                if (getLeb() == DW_REG_FP) fp_off = DW_SAME_FP;
+                _ptr += getLeb();
+                break;
+            case DW_CFA_val_offset:
+            case DW_CFA_val_offset_sf:
+                if (getLeb() == DW_REG_FP) fp_off = DW_SAME_FP;
+                getLeb();
+                break;
+            case DW_CFA_GNU_args_size:
+                getLeb();
+                break;
+            default:
+                // Unknown instruction: the rest of the FDE cannot be interpreted
+                cfa_reg = DW_REG_INVALID;
+                _ptr = end;
+                break;
+        }
+    }
+
+    if (!cie) addRecord(loc, cfa_reg, cfa_off, fp_off);
+}
+
+// The only CFA expression recognized is the one linkers emit for PLT entries:
+//   DW_OP_breg7 (rsp) N; DW_OP_breg16 (rip) 0; DW_OP_lit15; DW_OP_and; DW_OP_lit11; DW_OP_ge; DW_OP_lit3; DW_OP_shl; DW_OP_plus
+// i.e. CFA = rsp + N, plus one more word after the entry has pushed its argument.
+int DwarfParser::parseExpression(u32 length, int& cfa_off) {
+    if (length < 4 || (u8)_ptr[0] != DW_OP_breg_sp) {
+        return DW_REG_INVALID;
+    }
+    _ptr++;
+    int offset = getSLeb();
+    if ((u8)*_ptr != DW_OP_breg_pc) {
+        return DW_REG_INVALID;
+    }
+
+    cfa_off = offset;
+    return DW_REG_PLT;
+}
+
+void DwarfParser::addRecord(u32 loc, int cfa_reg, int cfa_off, int fp_off) {
+    if (_table == NULL) {
+        return;
+    }
+
+    // cfa_off may be negative, so shift it as unsigned
+    int cfa = (int)((u32)cfa_reg | (u32)cfa_off << 8);
+
+    if (_count > 0) {
+        FrameDesc* last = &_table[_count - 1];
+        if (last->loc == loc) {
+            // Rules for an empty address range are never used
+            last->cfa = cfa;
+            last->fp_off = fp_off;
+            return;
+        } else if (last->cfa == cfa && last->fp_off == fp_off) {
+            return;
+        }
+    }
+
+    if (_count >= _capacity) {
+        FrameDesc* table = (FrameDesc*)realloc(_table, _capacity * 2 * sizeof(FrameDesc));
+        if (table == NULL) {
+            free(_table);
+            _table = NULL;
+            _count = _capacity = 0;
+            return;
+        }
+        _table = table;
+        _capacity *= 2;
+    }
+
+    FrameDesc* fd = &_table[_count++];
+    fd->loc = loc;
+    fd->cfa = cfa;
+    fd->fp_off = fp_off;
+}
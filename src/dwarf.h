@@ -0,0 +1,166 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DWARF_H
+#define _DWARF_H
+
+#include <stddef.h>
+#include "arch.h"
+
+
+#if defined(__x86_64__)
+
+#define DWARF_SUPPORTED true
+
+const int DW_REG_FP = 6;
+const int DW_REG_SP = 7;
+const int DW_REG_PC = 16;
+
+#else
+
+#define DWARF_SUPPORTED false
+
+const int DW_REG_FP = 0;
+const int DW_REG_SP = 0;
+const int DW_REG_PC = 0;
+
+#endif
+
+// Pseudo-registers describing CFA rules that are not based on a single register
+const int DW_REG_PLT = 128;      // CFA of a PLT entry depends on the offset of PC within the entry
+const int DW_REG_INVALID = 255;  // CFA cannot be computed
+
+const int DW_SAME_FP = (int)0x80000000;  // frame pointer is not saved in the frame
+
+// Size of the stack frame right after a call instruction: only the return address
+const int EMPTY_FRAME_SIZE = sizeof(void*);
+// Size of the stack frame after the standard prologue: return address and saved frame pointer
+const int LINKED_FRAME_SIZE = 2 * sizeof(void*);
+
+
+// A row of the unwind table: from loc up to the next row, CFA = cfa_reg + cfa_off,
+// and the caller's frame pointer is saved at CFA + fp_off. The return address is right below CFA.
+struct FrameDesc {
+    u32 loc;  // offset from the image base
+    int cfa;  // cfa_reg | cfa_off << 8
+    int fp_off;
+
+    static FrameDesc default_frame;
+
+    int cfaReg() const {
+        return cfa & 0xff;
+    }
+
+    int cfaOff() const {
+        return cfa >> 8;
+    }
+
+    static int comparator(const void* p1, const void* p2);
+};
+
+
+// Compiles .eh_frame call frame information of a loaded library into a table of FrameDesc,
+// sorted by address. The library is parsed in memory starting from its .eh_frame_hdr,
+// which is mapped together with code as part of the PT_GNU_EH_FRAME segment.
+class DwarfParser {
+  private:
+    const char* _name;
+    const char* _image_base;
+    const char* _ptr;
+
+    int _capacity;
+    int _count;
+    FrameDesc* _table;
+
+    u32 _code_align;
+    int _data_align;
+    u8 _fde_encoding;
+    bool _fde_augmentation;
+    const char* _cie_instructions;
+    const char* _cie_end;
+    int _initial_fp_off;
+
+    u8 get8() {
+        return *_ptr++;
+    }
+
+    u16 get16() {
+        u16 result = *(const u16*)_ptr;
+        _ptr += 2;
+        return result;
+    }
+
+    u32 get32() {
+        u32 result = *(const u32*)_ptr;
+        _ptr += 4;
+        return result;
+    }
+
+    u64 get64() {
+        u64 result = *(const u64*)_ptr;
+        _ptr += 8;
+        return result;
+    }
+
+    u32 getLeb() {
+        u32 result = 0;
+        for (u32 shift = 0; ; shift += 7) {
+            u8 b = *_ptr++;
+            result |= (u32)(b & 0x7f) << (shift & 31);
+            if ((b & 0x80) == 0) {
+                return result;
+            }
+        }
+    }
+
+    int getSLeb() {
+        u32 result = 0;
+        for (u32 shift = 0; ; shift += 7) {
+            u8 b = *_ptr++;
+            result |= (u32)(b & 0x7f) << (shift & 31);
+            if ((b & 0x80) == 0) {
+                if ((b & 0x40) != 0 && (shift += 7) < 32) {
+                    result |= ~0U << shift;
+                }
+                return (int)result;
+            }
+        }
+    }
+
+    u64 getEncoded(u8 encoding);
+    const char* getPtr(u8 encoding);
+
+    void parse(const char* eh_frame_hdr);
+    bool parseCie(const char* cie);
+    void parseFde(const char* fde, u32 loc);
+    void parseInstructions(u32 loc, const char* end, int& cfa_reg, int& cfa_off, int& fp_off, bool cie);
+    int parseExpression(u32 length, int& cfa_off);
+
+    void addRecord(u32 loc, int cfa_reg, int cfa_off, int fp_off);
+
+  public:
+    DwarfParser(const char* name, const char* image_base, const char* eh_frame_hdr);
+
+    FrameDesc* table() const {
+        return _table;
+    }
+
+    int count() const {
+        return _count;
+    }
+};
+
+#endif // _DWARF_H
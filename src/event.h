@@ -31,8 +31,10 @@ class Event {
 class ExecutionEvent : public Event {
   public:
     ThreadState _thread_state;
+    const u64* _group;  // hardware counters of a perf_events group, if any
+    const void* _data_addr;  // sampled data address, if any
 
-    ExecutionEvent() : _thread_state(THREAD_RUNNING) {
+    ExecutionEvent() : _thread_state(THREAD_RUNNING), _group(NULL), _data_addr(NULL) {
     }
 };
 
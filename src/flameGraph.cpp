@@ -87,8 +87,8 @@ static const char FLAMEGRAPH_HEADER[] =
     "\t\treturn '#' + (p[0] + ((p[1] * v) << 16 | (p[2] * v) << 8 | (p[3] * v))).toString(16);\n"
     "\t}\n"
     "\n"
-    "\tfunction f(level, left, width, type, title) {\n"
-    "\t\tlevels[level].push({left: left, width: width, color: getColor(palette[type]), title: title});\n"
+    "\tfunction f(level, left, width, type, title, info) {\n"
+    "\t\tlevels[level].push({left: left, width: width, color: getColor(palette[type]), title: title, info: info});\n"
     "\t}\n"
     "\n"
     "\tfunction samples(n) {\n"
@@ -203,7 +203,7 @@ static const char FLAMEGRAPH_HEADER[] =
     "\t\t\t\thl.style.top = ((reverse ? h * 16 : canvasHeight - (h + 1) * 16) + canvas.offsetTop) + 'px';\n"
     "\t\t\t\thl.firstChild.textContent = f.title;\n"
     "\t\t\t\thl.style.display = 'block';\n"
-    "\t\t\t\tcanvas.title = f.title + '\\n(' + samples(f.width) + ', ' + pct(f.width, levels[0][0].width) + '%%)';\n"
+    "\t\t\t\tcanvas.title = f.title + '\\n(' + samples(f.width) + ', ' + pct(f.width, levels[0][0].width) + '%%' + (f.info ? ', ' + f.info : '') + ')';\n"
     "\t\t\t\tcanvas.style.cursor = 'pointer';\n"
     "\t\t\t\tcanvas.onclick = function() {\n"
     "\t\t\t\t\tif (f != root) {\n"
@@ -497,7 +497,12 @@ void FlameGraph::printFrame(std::ostream& out, const std::string& name, const Tr
     int type = frameType(name_copy);
     StringUtils::replace(name_copy, '\'', "\\'", 2);
 
-    snprintf(_buf, sizeof(_buf) - 1, "f(%d,%llu,%llu,%d,'%s')\n", level, x, f._total, type, name_copy.c_str());
+    char info[128];
+    if (GroupCounters::format(info, sizeof(info), f._group.values) > 0) {
+        snprintf(_buf, sizeof(_buf) - 1, "f(%d,%llu,%llu,%d,'%s','%s')\n", level, x, f._total, type, name_copy.c_str(), info);
+    } else {
+        snprintf(_buf, sizeof(_buf) - 1, "f(%d,%llu,%llu,%d,'%s')\n", level, x, f._total, type, name_copy.c_str());
+    }
     out << _buf;
 
     x += f._self;
@@ -526,18 +531,24 @@ void FlameGraph::printTreeFrame(std::ostream& out, const Trie& f, int level) {
         StringUtils::replace(name, '<', "&lt;", 4);
         StringUtils::replace(name, '>', "&gt;", 4);
 
+        char info[128];
+        info[0] = ' ';
+        if (GroupCounters::format(info + 1, sizeof(info) - 1, trie->_group.values) == 0) {
+            info[0] = 0;
+        }
+
         if (_reverse) {
             snprintf(_buf, sizeof(_buf) - 1,
-                     "<li><div>[%d] %.2f%% %s</div><span class=\"t%d\"> %s</span>\n",
+                     "<li><div>[%d] %.2f%% %s%s</div><span class=\"t%d\"> %s</span>\n",
                      level,
-                     trie->_total * pct, Format().thousands(trie->_total),
+                     trie->_total * pct, Format().thousands(trie->_total), info,
                      type, name.c_str());
         } else {
             snprintf(_buf, sizeof(_buf) - 1,
-                     "<li><div>[%d] %.2f%% %s self: %.2f%% %s</div><span class=\"t%d\"> %s</span>\n",
+                     "<li><div>[%d] %.2f%% %s self: %.2f%% %s%s</div><span class=\"t%d\"> %s</span>\n",
                      level,
                      trie->_total * pct, Format().thousands(trie->_total),
-                     trie->_self * pct, Format().thousands(trie->_self),
+                     trie->_self * pct, Format().thousands(trie->_self), info,
                      type, name.c_str());
         }
         out << _buf;
@@ -22,6 +22,7 @@
 #include <iostream>
 #include "arch.h"
 #include "arguments.h"
+#include "callTraceStorage.h"
 
 
 class Trie {
@@ -29,18 +30,21 @@ class Trie {
     std::map<std::string, Trie> _children;
     u64 _total;
     u64 _self;
+    GroupCounters _group;
 
-    Trie() : _children(), _total(0), _self(0) {
+    Trie() : _children(), _total(0), _self(0), _group() {
     }
     
-    Trie* addChild(const std::string& key, u64 value) {
+    Trie* addChild(const std::string& key, u64 value, const u64* group = NULL) {
         _total += value;
+        if (group != NULL) _group += group;
         return &_children[key];
     }
 
-    void addLeaf(u64 value) {
+    void addLeaf(u64 value, const u64* group = NULL) {
         _total += value;
         _self += value;
+        if (group != NULL) _group += group;
     }
 
     int depth(u64 cutoff) const {
@@ -29,6 +29,7 @@
 #include "flightRecorder.h"
 #include "jfrMetadata.h"
 #include "dictionary.h"
+#include "memoryUsage.h"
 #include "os.h"
 #include "profiler.h"
 #include "symbols.h"
@@ -49,7 +50,7 @@ const int MAX_STRING_LENGTH = 8191;
 
 
 static const char* const SETTING_RING[] = {NULL, "kernel", "user"};
-static const char* const SETTING_CSTACK[] = {NULL, "no", "fp", "lbr"};
+static const char* const SETTING_CSTACK[] = {NULL, "no", "fp", "lbr", "dwarf"};
 
 
 enum FrameTypeId {
@@ -241,6 +242,7 @@ class Recording {
     Dictionary _packages;
     Dictionary _symbols;
     std::map<jmethodID, MethodInfo> _method_map;
+    size_t _method_map_bytes;
     u64 _start_time;
     u64 _start_nanos;
     u64 _stop_time;
@@ -249,13 +251,17 @@ class Recording {
     int _available_processors;
     Buffer _cpu_monitor_buf;
     Timer* _cpu_monitor;
+    bool _record_cpu_load;
+    bool _record_memory_usage;
     CpuTimes _last_times;
 
-    void startCpuMonitor(bool enabled) {
+    void startCpuMonitor(bool cpu_load, bool memory_usage) {
         _last_times.proc.real = OS::getProcessCpuTime(&_last_times.proc.user, &_last_times.proc.system);
         _last_times.total.real = OS::getTotalCpuTime(&_last_times.total.user, &_last_times.total.system);
 
-        _cpu_monitor = enabled ? OS::startTimer(1000000000, cpuMonitorCallback, this) : NULL;
+        _record_cpu_load = cpu_load;
+        _record_memory_usage = memory_usage;
+        _cpu_monitor = cpu_load || memory_usage ? OS::startTimer(1000000000, cpuMonitorCallback, this) : NULL;
         _cpu_monitor_lock.unlock();
     }
 
@@ -267,6 +273,18 @@ class Recording {
     }
 
     void cpuMonitorCycle() {
+        if (_record_cpu_load) {
+            cpuLoadCycle();
+        }
+        if (_record_memory_usage) {
+            for (int i = 0; i < MEM_CATEGORIES; i++) {
+                recordMemoryUsage(&_cpu_monitor_buf, (MemoryCategory)i);
+                flushIfNeeded(&_cpu_monitor_buf, BUFFER_LIMIT);
+            }
+        }
+    }
+
+    void cpuLoadCycle() {
         CpuTimes times;
         times.proc.real = OS::getProcessCpuTime(&times.proc.user, &times.proc.system);
         times.total.real = OS::getTotalCpuTime(&times.total.user, &times.total.system);
@@ -306,7 +324,7 @@ class Recording {
     }
 
   public:
-    Recording(int fd, Arguments& args) : _fd(fd), _thread_set(), _packages(), _symbols(), _method_map() {
+    Recording(int fd, Arguments& args) : _fd(fd), _thread_set(), _packages(), _symbols(), _method_map(), _method_map_bytes(0) {
         _chunk_start = lseek(_fd, 0, SEEK_END);
         _start_time = OS::millis();
         _start_nanos = OS::nanotime();
@@ -327,7 +345,7 @@ class Recording {
         }
         flush(_buf);
 
-        startCpuMonitor(!args.hasOption(NO_CPU_LOAD));
+        startCpuMonitor(!args.hasOption(NO_CPU_LOAD), !args.hasOption(NO_MEMORY_USAGE));
     }
 
     ~Recording() {
@@ -368,6 +386,7 @@ class Recording {
         }
 
         close(_fd);
+        MemoryUsage::release(MEM_JFR_METHODS, _method_map_bytes, _method_map.size());
     }
 
     static void JNICALL appendRecording(JNIEnv* env, jclass cls, jstring file_name) {
@@ -469,11 +488,17 @@ class Recording {
 
             if (method == NULL) {
                 fillNativeMethodInfo(mi, "unknown");
-            } else if (frame.bci == BCI_NATIVE_FRAME || frame.bci == BCI_ERROR) {
+            } else if (frame.bci == BCI_NATIVE_FRAME || frame.bci == BCI_ERROR || frame.bci == BCI_DATA) {
                 fillNativeMethodInfo(mi, (const char*)method);
             } else {
                 fillJavaMethodInfo(mi, method);
             }
+
+            // Estimate: tree node with 3 links and color, plus the line number table
+            size_t bytes = sizeof(std::map<jmethodID, MethodInfo>::value_type) + 4 * sizeof(void*)
+                         + mi->_line_number_table_size * sizeof(jvmtiLineNumberEntry);
+            _method_map_bytes += bytes;
+            MemoryUsage::allocate(MEM_JFR_METHODS, bytes);
         }
 
         return mi;
@@ -630,6 +655,8 @@ class Recording {
             writeIntSetting(buf, T_EXECUTION_SAMPLE, "interval", args._interval);
         }
 
+        writeBoolSetting(buf, T_PMU_SAMPLE, "enabled", args._pmu_group);
+
         writeBoolSetting(buf, T_ALLOC_IN_NEW_TLAB, "enabled", args._alloc > 0);
         writeBoolSetting(buf, T_ALLOC_OUTSIDE_TLAB, "enabled", args._alloc > 0);
         if (args._alloc > 0) {
@@ -785,7 +812,7 @@ class Recording {
         buf->putVar32(0);
         buf->putVar32(1);
 
-        buf->putVar32(9);
+        buf->putVar32(10);
 
         writeFrameTypes(buf);
         writeThreadStates(buf);
@@ -796,6 +823,7 @@ class Recording {
         writePackages(buf);
         writeSymbols(buf);
         writeLogLevels(buf);
+        writeMemoryCategories(buf);
     }
 
     void writeFrameTypes(Buffer* buf) {
@@ -856,12 +884,13 @@ class Recording {
 
     void writeStackTraces(Buffer* buf) {
         std::map<u32, CallTrace*> traces;
-        Profiler::instance()->_call_trace_storage.collectTraces(traces);
+        Profiler::instance()->_call_trace_storage->collectTraces(traces);
+        TraceExpander expander;
 
         buf->putVar32(T_STACK_TRACE);
         buf->putVar32(traces.size());
         for (std::map<u32, CallTrace*>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
-            CallTrace* trace = it->second;
+            CallTrace* trace = expander.expand(it->second);
             buf->putVar32(it->first);
             buf->putVar32(0);  // truncated
             buf->putVar32(trace->num_frames);
@@ -956,6 +985,15 @@ class Recording {
         }
     }
 
+    void writeMemoryCategories(Buffer* buf) {
+        buf->putVar32(T_MEMORY_CATEGORY);
+        buf->putVar32(MEM_CATEGORIES);
+        for (int i = 0; i < MEM_CATEGORIES; i++) {
+            buf->putVar32(i);
+            buf->putUtf8(MemoryUsage::CATEGORY_NAME[i]);
+        }
+    }
+
     void recordExecutionSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event) {
         int start = buf->skip(1);
         buf->put8(T_EXECUTION_SAMPLE);
@@ -966,6 +1004,18 @@ class Recording {
         buf->put8(start, buf->offset() - start);
     }
 
+    void recordPmuSample(Buffer* buf, int tid, u32 call_trace_id, const u64* group) {
+        int start = buf->skip(1);
+        buf->put8(T_PMU_SAMPLE);
+        buf->putVar64(OS::nanotime());
+        buf->putVar32(tid);
+        buf->putVar32(call_trace_id);
+        for (int i = 0; i < MAX_GROUP_COUNTERS; i++) {
+            buf->putVar64(group[i]);
+        }
+        buf->put8(start, buf->offset() - start);
+    }
+
     void recordAllocationInNewTLAB(Buffer* buf, int tid, u32 call_trace_id, AllocEvent* event) {
         int start = buf->skip(1);
         buf->put8(T_ALLOC_IN_NEW_TLAB);
@@ -1024,6 +1074,16 @@ class Recording {
         buf->put8(start, buf->offset() - start);
     }
 
+    void recordMemoryUsage(Buffer* buf, MemoryCategory category) {
+        int start = buf->skip(1);
+        buf->put8(T_MEMORY_USAGE);
+        buf->putVar64(OS::nanotime());
+        buf->putVar32(category);
+        buf->putVar64(MemoryUsage::bytes(category));
+        buf->putVar64(MemoryUsage::objects(category));
+        buf->put8(start, buf->offset() - start);
+    }
+
     void addThread(int tid) {
         if (!_thread_set.accept(tid)) {
             _thread_set.add(tid);
@@ -1098,6 +1158,9 @@ void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
         switch (event_type) {
             case 0:
                 _rec->recordExecutionSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
+                if (((ExecutionEvent*)event)->_group != NULL) {
+                    _rec->recordPmuSample(buf, tid, call_trace_id, ((ExecutionEvent*)event)->_group);
+                }
                 break;
             case BCI_ALLOC:
                 _rec->recordAllocationInNewTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
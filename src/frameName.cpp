@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "frameName.h"
+#include "memoryUsage.h"
 #include "profiler.h"
 #include "vmStructs.h"
 
@@ -77,6 +78,7 @@ bool Matcher::matches(const char* s) {
 
 FrameName::FrameName(Arguments& args, int style, Mutex& thread_names_lock, ThreadMap& thread_names) :
     _cache(),
+    _cache_bytes(0),
     _class_names(),
     _include(),
     _exclude(),
@@ -95,6 +97,7 @@ FrameName::FrameName(Arguments& args, int style, Mutex& thread_names_lock, Threa
 }
 
 FrameName::~FrameName() {
+    MemoryUsage::release(MEM_FRAME_NAMES, _cache_bytes, _cache.size());
     freelocale(uselocale(_saved_locale));
 }
 
@@ -112,15 +115,35 @@ char* FrameName::truncate(char* name, int max_length) {
     return name;
 }
 
+const char* FrameName::cacheName(JMethodCache::iterator hint, jmethodID key, const char* name) {
+    JMethodCache::iterator it = _cache.insert(hint, JMethodCache::value_type(key, name));
+
+    // Estimate: tree node with 3 links and color, plus the string contents
+    size_t bytes = sizeof(JMethodCache::value_type) + 4 * sizeof(void*) + it->second.capacity() + 1;
+    _cache_bytes += bytes;
+    MemoryUsage::allocate(MEM_FRAME_NAMES, bytes);
+    return it->second.c_str();
+}
+
 const char* FrameName::cppDemangle(const char* name) {
     if (name != NULL && name[0] == '_' && name[1] == 'Z') {
+        // Native frame names are owned by NativeCodeCache and live as long as the profiler,
+        // so the pointer identifies a symbol. It never clashes with a live jmethodID.
+        jmethodID key = (jmethodID)name;
+        JMethodCache::iterator it = _cache.lower_bound(key);
+        if (it != _cache.end() && it->first == key) {
+            return it->second.c_str();
+        }
+
         int status;
         char* demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
-        if (demangled != NULL) {
-            strncpy(_buf, demangled, sizeof(_buf) - 1);
-            free(demangled);
-            return _buf;
+        if (demangled == NULL) {
+            return cacheName(it, key, name);
         }
+
+        strncpy(_buf, demangled, sizeof(_buf) - 1);
+        free(demangled);
+        return cacheName(it, key, _buf);
     }
     return name;
 }
@@ -244,15 +267,18 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
             return _buf;
         }
 
+        case BCI_DATA: {
+            snprintf(_buf, sizeof(_buf) - 1, "[data] %s", (const char*)frame.method_id);
+            return _buf;
+        }
+
         default: {
             JMethodCache::iterator it = _cache.lower_bound(frame.method_id);
             if (it != _cache.end() && it->first == frame.method_id) {
                 return it->second.c_str();
             }
 
-            const char* newName = javaMethodName(frame.method_id);
-            _cache.insert(it, JMethodCache::value_type(frame.method_id, newName));
-            return newName;
+            return cacheName(it, frame.method_id, javaMethodName(frame.method_id));
         }
     }
 }
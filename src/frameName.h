@@ -64,6 +64,7 @@ class Matcher {
 class FrameName {
   private:
     JMethodCache _cache;
+    size_t _cache_bytes;
     ClassMap _class_names;
     std::vector<Matcher> _include;
     std::vector<Matcher> _exclude;
@@ -75,6 +76,7 @@ class FrameName {
 
     void buildFilter(std::vector<Matcher>& vector, const char* base, int offset);
     char* truncate(char* name, int max_length);
+    const char* cacheName(JMethodCache::iterator hint, jmethodID key, const char* name);
     const char* cppDemangle(const char* name);
     char* javaMethodName(jmethodID method);
     char* javaClassName(const char* symbol, int length, int style);
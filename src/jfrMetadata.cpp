@@ -85,6 +85,9 @@ JfrMetadata::JfrMetadata() : Element("root") {
             << (type("profiler.types.LogLevel", T_LOG_LEVEL, "Log Level", true)
                 << field("name", T_STRING, "Name"))
 
+            << (type("profiler.types.MemoryCategory", T_MEMORY_CATEGORY, "Memory Category", true)
+                << field("name", T_STRING, "Name"))
+
             << (type("jdk.ExecutionSample", T_EXECUTION_SAMPLE, "Method Profiling Sample")
                 << category("Java Virtual Machine", "Profiling")
                 << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
@@ -201,6 +204,23 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("level", T_LOG_LEVEL, "Level", F_CPOOL)
                 << field("message", T_STRING, "Message"))
 
+            << (type("profiler.MemoryUsage", T_MEMORY_USAGE, "Profiler Memory Usage")
+                << category("Profiler")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("category", T_MEMORY_CATEGORY, "Category", F_CPOOL)
+                << field("used", T_LONG, "Used Memory", F_BYTES)
+                << field("objects", T_LONG, "Objects"))
+
+            << (type("profiler.PmuSample", T_PMU_SAMPLE, "PMU Counters Sample")
+                << category("Profiler")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("sampledThread", T_THREAD, "Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("cycles", T_LONG, "Cycles")
+                << field("instructions", T_LONG, "Instructions")
+                << field("cacheMisses", T_LONG, "Cache Misses")
+                << field("branchMisses", T_LONG, "Branch Misses"))
+
             << (type("jdk.jfr.Label", T_LABEL, NULL)
                 << field("value", T_STRING))
 
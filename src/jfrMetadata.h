@@ -49,6 +49,7 @@ enum JfrType {
     T_PACKAGE = 29,
     T_SYMBOL = 30,
     T_LOG_LEVEL = 31,
+    T_MEMORY_CATEGORY = 32,
 
     T_EVENT = 100,
     T_EXECUTION_SAMPLE = 101,
@@ -65,6 +66,8 @@ enum JfrType {
     T_INITIAL_SYSTEM_PROPERTY = 112,
     T_NATIVE_LIBRARY = 113,
     T_LOG = 114,
+    T_MEMORY_USAGE = 115,
+    T_PMU_SAMPLE = 116,
 
     T_ANNOTATION = 200,
     T_LABEL = 201,
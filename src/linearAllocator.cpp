@@ -15,12 +15,18 @@
  */
 
 #include "linearAllocator.h"
-#include "os.h"
 
 
-LinearAllocator::LinearAllocator(size_t chunk_size) {
+LinearAllocator::LinearAllocator(size_t chunk_size, MemoryCategory category) {
     _chunk_size = chunk_size;
+    _category = category;
+    _limit = 0;
+    _chunks = 0;
+    _limit_reached = false;
+    _use_huge_pages = false;
+    _huge_pages = HUGE_PAGES_NONE;
     _reserve = _tail = allocateChunk(NULL);
+    clearSlabs();
 }
 
 LinearAllocator::~LinearAllocator() {
@@ -39,6 +45,14 @@ void LinearAllocator::clear() {
     }
     _reserve = _tail;
     _tail->offs = sizeof(Chunk);
+    _limit_reached = false;
+    clearSlabs();
+}
+
+void LinearAllocator::clearSlabs() {
+    for (int i = 0; i < MAX_SLABS; i++) {
+        _slabs[i].ptr = _slabs[i].end = NULL;
+    }
 }
 
 void* LinearAllocator::alloc(size_t size) {
@@ -60,17 +74,58 @@ void* LinearAllocator::alloc(size_t size) {
     return NULL;
 }
 
+void* LinearAllocator::alloc(size_t size, int slab_index) {
+    if ((unsigned int)slab_index >= MAX_SLABS || size > SLAB_SIZE / 4) {
+        return alloc(size);
+    }
+
+    // Fast path: bump a private pointer
+    Slab* slab = &_slabs[slab_index];
+    if (slab->ptr != NULL && slab->ptr + size <= slab->end) {
+        void* result = slab->ptr;
+        slab->ptr += size;
+        return result;
+    }
+
+    // Carve a new slab from the shared chunk; the rest of the old slab is wasted
+    char* start = (char*)alloc(SLAB_SIZE);
+    if (start == NULL) {
+        return alloc(size);
+    }
+    slab->ptr = start + size;
+    slab->end = start + SLAB_SIZE;
+    return start;
+}
+
 Chunk* LinearAllocator::allocateChunk(Chunk* current) {
-    Chunk* chunk = (Chunk*)OS::safeAlloc(_chunk_size);
+    if (_limit > 0 && current != NULL && (size_t)(_chunks + 1) * _chunk_size > _limit) {
+        _limit_reached = true;
+        return NULL;
+    }
+
+    Chunk* chunk;
+    if (_use_huge_pages) {
+        HugePages huge_pages;
+        chunk = (Chunk*)OS::safeAllocHuge(_chunk_size, &huge_pages);
+        _huge_pages = huge_pages;
+    } else {
+        chunk = (Chunk*)OS::safeAlloc(_chunk_size);
+        _huge_pages = HUGE_PAGES_NONE;
+    }
+
     if (chunk != NULL) {
         chunk->prev = current;
         chunk->offs = sizeof(Chunk);
+        atomicInc(_chunks);
+        MemoryUsage::allocate(_category, _chunk_size);
     }
     return chunk;
 }
 
 void LinearAllocator::freeChunk(Chunk* current) {
     OS::safeFree(current, _chunk_size);
+    atomicInc(_chunks, -1);
+    MemoryUsage::release(_category, _chunk_size);
 }
 
 void LinearAllocator::reserveChunk(Chunk* current) {
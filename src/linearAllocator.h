@@ -18,8 +18,13 @@
 #define _LINEARALLOCATOR_H
 
 #include <stddef.h>
+#include "memoryUsage.h"
+#include "os.h"
 
 
+const int MAX_SLABS = 16;
+const size_t SLAB_SIZE = 32 * 1024;
+
 struct Chunk {
     Chunk* prev;
     volatile size_t offs;
@@ -27,24 +32,70 @@ struct Chunk {
     char _padding[56];
 };
 
+// Part of a chunk privately owned by one allocating thread
+struct Slab {
+    char* ptr;
+    char* end;
+    // To avoid false sharing
+    char _padding[48];
+};
+
 class LinearAllocator {
   private:
     size_t _chunk_size;
+    MemoryCategory _category;
+    size_t _limit;
+    volatile int _chunks;
+    volatile bool _limit_reached;
+    bool _use_huge_pages;
+    HugePages _huge_pages;
     Chunk* _tail;
     Chunk* _reserve;
+    Slab _slabs[MAX_SLABS];
 
     Chunk* allocateChunk(Chunk* current);
     void freeChunk(Chunk* current);
     void reserveChunk(Chunk* current);
     Chunk* getNextChunk(Chunk* current);
+    void clearSlabs();
 
   public:
-    LinearAllocator(size_t chunk_size);
+    LinearAllocator(size_t chunk_size, MemoryCategory category);
     ~LinearAllocator();
 
     void clear();
 
     void* alloc(size_t size);
+
+    // Allocates from a private slab without atomic operations. The caller must guarantee
+    // that no other thread uses the same slab_index concurrently.
+    void* alloc(size_t size, int slab_index);
+
+    // Maximum memory for all chunks, 0 means unlimited. Raising the limit allows new chunks again.
+    void setLimit(size_t limit) {
+        if (limit == 0 || limit > _limit) {
+            _limit_reached = false;
+        }
+        _limit = limit;
+    }
+
+    // True if a new chunk has been refused because of the limit
+    bool limitReached() {
+        return _limit_reached;
+    }
+
+    void setHugePages(bool use_huge_pages) {
+        _use_huge_pages = use_huge_pages;
+    }
+
+    // What kind of pages backs the most recently allocated chunk
+    HugePages hugePages() {
+        return _huge_pages;
+    }
+
+    size_t usedMemory() {
+        return (size_t)_chunks * _chunk_size;
+    }
 };
 
 #endif // _LINEARALLOCATOR_H
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "memoryUsage.h"
+
+
+volatile u64 MemoryUsage::_bytes[MEM_CATEGORIES];
+volatile u64 MemoryUsage::_objects[MEM_CATEGORIES];
+
+const char* const MemoryUsage::CATEGORY_NAME[] = {
+    "call trace tables",
+    "call trace chunks",
+    "expanded traces",
+    "dictionaries",
+    "code blobs",
+    "symbol names",
+    "unwind tables",
+    "frame name cache",
+    "JFR method map"
+};
+
+u64 MemoryUsage::totalBytes() {
+    u64 total = 0;
+    for (int i = 0; i < MEM_CATEGORIES; i++) {
+        total += _bytes[i];
+    }
+    return total;
+}
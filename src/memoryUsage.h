@@ -0,0 +1,70 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _MEMORYUSAGE_H
+#define _MEMORYUSAGE_H
+
+#include <stddef.h>
+#include "arch.h"
+
+
+enum MemoryCategory {
+    MEM_TRACE_TABLES,
+    MEM_TRACE_CHUNKS,
+    MEM_EXPANDED_TRACES,
+    MEM_DICTIONARIES,
+    MEM_CODE_BLOBS,
+    MEM_SYMBOL_NAMES,
+    MEM_UNWIND_TABLES,
+    MEM_FRAME_NAMES,
+    MEM_JFR_METHODS,
+    MEM_CATEGORIES
+};
+
+
+// Accounts native memory owned by the profiler itself, broken down by subsystem.
+// Counters are updated atomically and do not allocate, so they are safe in signal handlers.
+class MemoryUsage {
+  private:
+    static volatile u64 _bytes[MEM_CATEGORIES];
+    static volatile u64 _objects[MEM_CATEGORIES];
+
+  public:
+    static const char* const CATEGORY_NAME[];
+
+    static void allocate(MemoryCategory category, size_t bytes, u64 objects = 1) {
+        atomicInc(_bytes[category], bytes);
+        atomicInc(_objects[category], objects);
+    }
+
+    static void release(MemoryCategory category, size_t bytes, u64 objects = 1) {
+        atomicInc(_bytes[category], 0 - (u64)bytes);
+        atomicInc(_objects[category], 0 - objects);
+    }
+
+    static u64 bytes(MemoryCategory category) {
+        return _bytes[category];
+    }
+
+    static u64 objects(MemoryCategory category) {
+        return _objects[category];
+    }
+
+    static u64 totalBytes();
+};
+
+#endif // _MEMORYUSAGE_H
@@ -27,6 +27,12 @@ typedef void (*SigAction)(int, siginfo_t*, void*);
 typedef void (*SigHandler)(int);
 typedef void (*TimerCallback)(void*);
 
+enum HugePages {
+    HUGE_PAGES_NONE,
+    HUGE_PAGES_THP,     // Transparent huge pages requested with madvise
+    HUGE_PAGES_HUGETLB  // Explicit huge pages from the reserved pool
+};
+
 enum ThreadState {
     THREAD_INVALID,
     THREAD_RUNNING,
@@ -84,6 +90,7 @@ class OS {
     static bool sendSignalToThread(int thread_id, int signo);
 
     static void* safeAlloc(size_t size);
+    static void* safeAllocHuge(size_t size, HugePages* huge_pages);
     static void safeFree(void* addr, size_t size);
 
     static Timer* startTimer(u64 interval, TimerCallback callback, void* arg);
@@ -20,6 +20,7 @@
 #include <byteswap.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,6 +42,16 @@
 #  define MMAP_SYSCALL __NR_mmap2
 #endif
 
+#ifndef MAP_HUGETLB
+#  define MAP_HUGETLB 0x40000
+#endif
+
+#ifndef MADV_HUGEPAGE
+#  define MADV_HUGEPAGE 14
+#endif
+
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
 
 class LinuxThreadList : public ThreadList {
   private:
@@ -252,6 +263,46 @@ void* OS::safeAlloc(size_t size) {
     return (void*)result;
 }
 
+// Backs the memory region with huge pages if possible, silently falling back to regular pages.
+// Sizes that are multiples of the huge page size are first tried with MAP_HUGETLB;
+// otherwise the region is aligned to the huge page boundary and marked with MADV_HUGEPAGE.
+void* OS::safeAllocHuge(size_t size, HugePages* huge_pages) {
+    *huge_pages = HUGE_PAGES_NONE;
+
+    intptr_t result;
+    if ((size & (HUGE_PAGE_SIZE - 1)) == 0) {
+        result = syscall(MMAP_SYSCALL, NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (result >= 0 || result <= -4096) {
+            *huge_pages = HUGE_PAGES_HUGETLB;
+            return (void*)result;
+        }
+    }
+
+    if (size < HUGE_PAGE_SIZE) {
+        return safeAlloc(size);
+    }
+
+    // Reserve extra space to cut an aligned region out of it
+    result = syscall(MMAP_SYSCALL, NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (result < 0 && result > -4096) {
+        return NULL;
+    }
+
+    uintptr_t start = (uintptr_t)result;
+    uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    if (aligned > start) {
+        syscall(__NR_munmap, start, aligned - start);
+    }
+    if (start + HUGE_PAGE_SIZE > aligned) {
+        syscall(__NR_munmap, aligned + size, start + HUGE_PAGE_SIZE - aligned);
+    }
+
+    if (syscall(__NR_madvise, aligned, size, MADV_HUGEPAGE) == 0) {
+        *huge_pages = HUGE_PAGES_THP;
+    }
+    return (void*)aligned;
+}
+
 void OS::safeFree(void* addr, size_t size) {
     syscall(__NR_munmap, addr, size);
 }
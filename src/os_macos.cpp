@@ -238,6 +238,12 @@ void* OS::safeAlloc(size_t size) {
     return result;
 }
 
+void* OS::safeAllocHuge(size_t size, HugePages* huge_pages) {
+    // Superpages are not supported for anonymous mmap on macOS
+    *huge_pages = HUGE_PAGES_NONE;
+    return safeAlloc(size);
+}
+
 void OS::safeFree(void* addr, size_t size) {
     munmap(addr, size);
 }
@@ -18,7 +18,9 @@
 #define _PERFEVENTS_H
 
 #include <signal.h>
+#include <pthread.h>
 #include "engine.h"
+#include "spinLock.h"
 
 
 class PerfEvent;
@@ -32,9 +34,42 @@ class PerfEvents : public Engine {
     static long _interval;
     static Ring _ring;
     static CStack _cstack;
+    static bool _native_only;
+    static bool _per_cpu;
+    static bool _pmu_group;
+    static bool _data_addr;
+    static int _ring_pages;
+
+    static volatile bool _draining;
+    static pthread_t _drain_thread;
+
+    // Threads with a live ring buffer in nativeonly mode, visited by the drain thread
+    static int* _ring_tids;
+    static volatile int _ring_tid_count;
+    static SpinLock _ring_tids_lock;
+    // Threads left without a ring buffer in nativeonly mode, e.g. due to RLIMIT_MEMLOCK
+    static volatile int _ring_failures;
 
     static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
 
+    static void* drainThreadEntry(void* arg) {
+        drainLoop();
+        return NULL;
+    }
+
+    static int openEvent(PerfEvent* event, int pid, int cpu, unsigned long flags);
+    static int openGroupCounters(PerfEvent* event, int group_fd, int pid, int cpu, unsigned long flags,
+                                 bool exclude_kernel, bool exclude_user);
+    static void closeEvent(PerfEvent* event);
+    static int openCgroup();
+
+    static const void* peekDataAddress(int tid);
+
+    static void drainLoop();
+    static void trackRing(int tid);
+    static void untrackRing(int tid);
+    static void drainBuffer(PerfEvent* event);
+
   public:
     Error check(Arguments& args);
     Error start(Arguments& args);
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <dlfcn.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/ioctl.h>
@@ -51,6 +52,10 @@ struct f_owner_ex {
 };
 #endif // F_SETOWN_EX
 
+#ifndef PERF_FLAG_PID_CGROUP
+#define PERF_FLAG_PID_CGROUP  (1UL << 2)
+#endif
+
 
 enum {
     HW_BREAKPOINT_R  = 1,
@@ -454,34 +459,53 @@ FunctionWithCounter PerfEventType::KNOWN_FUNCTIONS[] = {
 class RingBuffer {
   private:
     const char* _start;
+    unsigned long _mask;
     unsigned long _offset;
 
   public:
-    RingBuffer(struct perf_event_mmap_page* page) {
+    RingBuffer(struct perf_event_mmap_page* page, int data_pages = 1) {
         _start = (const char*)page + OS::page_size;
+        _mask = data_pages * OS::page_size - 1;
     }
 
     struct perf_event_header* seek(u64 offset) {
-        _offset = (unsigned long)offset & OS::page_mask;
+        _offset = (unsigned long)offset & _mask;
         return (struct perf_event_header*)(_start + _offset);
     }
 
     u64 next() {
-        _offset = (_offset + sizeof(u64)) & OS::page_mask;
+        _offset = (_offset + sizeof(u64)) & _mask;
         return *(u64*)(_start + _offset);
     }
 
     u64 peek(unsigned long words) {
-        unsigned long peek_offset = (_offset + words * sizeof(u64)) & OS::page_mask;
+        unsigned long peek_offset = (_offset + words * sizeof(u64)) & _mask;
         return *(u64*)(_start + peek_offset);
     }
 };
 
+// In native-only mode, samples are accumulated in larger ring buffers and drained periodically
+const int NATIVE_ONLY_RING_PAGES = 16;
+// A per-CPU buffer is shared by all threads running on that CPU
+const int PER_CPU_RING_PAGES = 64;
+const long DRAIN_INTERVAL = 10000000;  // 10 ms
+
+
+// Counting events read together with the sampling event in pmugroup mode, see GroupCounter
+static const u64 GROUP_COUNTER_CONFIG[MAX_GROUP_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+
 
 class PerfEvent : public SpinLock {
   private:
     int _fd;
+    int _siblings[MAX_GROUP_COUNTERS];
     struct perf_event_mmap_page* _page;
+    int _ring_slot;
 
     friend class PerfEvents;
 };
@@ -493,13 +517,75 @@ PerfEventType* PerfEvents::_event_type = NULL;
 long PerfEvents::_interval;
 Ring PerfEvents::_ring;
 CStack PerfEvents::_cstack;
+bool PerfEvents::_native_only = false;
+bool PerfEvents::_per_cpu = false;
+bool PerfEvents::_pmu_group = false;
+bool PerfEvents::_data_addr = false;
+int PerfEvents::_ring_pages = 1;
+volatile bool PerfEvents::_draining = false;
+pthread_t PerfEvents::_drain_thread;
+int* PerfEvents::_ring_tids = NULL;
+volatile int PerfEvents::_ring_tid_count = 0;
+SpinLock PerfEvents::_ring_tids_lock;
+volatile int PerfEvents::_ring_failures = 0;
 
 int PerfEvents::createForThread(int tid) {
+    if (_per_cpu) {
+        return 0;  // threads are covered by per-CPU events
+    }
+
     if (tid >= _max_events) {
         Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_events);
         return -1;
     }
 
+    int result = openEvent(&_events[tid], tid, -1, 0);
+    if (result == 0 && _native_only && _events[tid]._page != NULL) {
+        trackRing(tid);
+    }
+    return result;
+}
+
+void PerfEvents::destroyForThread(int tid) {
+    if (_per_cpu || tid >= _max_events) {
+        return;
+    }
+
+    if (_native_only) {
+        untrackRing(tid);
+    }
+    closeEvent(&_events[tid]);
+}
+
+void PerfEvents::trackRing(int tid) {
+    PerfEvent* event = &_events[tid];
+    _ring_tids_lock.lock();
+    int slot = event->_ring_slot;
+    if (slot >= _ring_tid_count || _ring_tids[slot] != tid) {
+        event->_ring_slot = _ring_tid_count;
+        _ring_tids[_ring_tid_count] = tid;
+        _ring_tid_count = _ring_tid_count + 1;
+    }
+    _ring_tids_lock.unlock();
+}
+
+// Moves the last tracked tid into the freed slot. The drain thread reads the list without a lock,
+// so it may skip the moved tid for one cycle; a ring being removed is drained by closeEvent() anyway.
+void PerfEvents::untrackRing(int tid) {
+    PerfEvent* event = &_events[tid];
+    _ring_tids_lock.lock();
+    int slot = event->_ring_slot;
+    if (slot < _ring_tid_count && _ring_tids[slot] == tid) {
+        int last = _ring_tids[_ring_tid_count - 1];
+        _ring_tids[slot] = last;
+        _events[last]._ring_slot = slot;
+        _ring_tid_count = _ring_tid_count - 1;
+    }
+    _ring_tids_lock.unlock();
+}
+
+// Opens a perf_event for the given thread (cpu == -1), or for the given cgroup on the given cpu
+int PerfEvents::openEvent(PerfEvent* event, int pid, int cpu, unsigned long flags) {
     PerfEventType* event_type = _event_type;
     if (event_type == NULL) {
         return -1;
@@ -527,48 +613,92 @@ int PerfEvents::createForThread(int tid) {
     attr.disabled = 1;
     attr.wakeup_events = 1;
 
+    if (_native_only) {
+        // Nobody waits for the ring buffer: the drain thread polls it
+        attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+        attr.wakeup_events = 0;
+    }
+
     if (_ring == RING_USER) {
         attr.exclude_kernel = 1;
     } else if (_ring == RING_KERNEL) {
         attr.exclude_user = 1;
     }
 
+    if (_pmu_group) {
+        // The signal handler reads the sampling event and all counters at once
+        attr.read_format = PERF_FORMAT_GROUP;
+    }
+
+    if (_data_addr) {
+        // Precise events (PEBS, IBS) are needed for the data address to match the sampled instruction
+        attr.sample_type |= PERF_SAMPLE_ADDR;
+        if (attr.type != PERF_TYPE_SOFTWARE && attr.type != PERF_TYPE_BREAKPOINT) {
+            attr.precise_ip = 1;
+        }
+    }
+
 #ifdef PERF_ATTR_SIZE_VER5
     if (_cstack == CSTACK_LBR) {
         attr.sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
         attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
         attr.sample_regs_user = 1ULL << PERF_REG_PC;
         attr.exclude_callchain_user = 1;
+    } else if (_cstack == CSTACK_DWARF) {
+        // User frames are unwound by the profiler
+        attr.exclude_callchain_user = 1;
     }
 #else
 #warning "Compiling without LBR support. Kernel headers 4.1+ required"
 #endif
 
-    int fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
+    int fd = syscall(__NR_perf_event_open, &attr, pid, cpu, -1, flags);
     if (fd == -1) {
         int err = errno;
         Log::warn("perf_event_open failed: %s", strerror(errno));
         return err;
     }
 
-    if (!__sync_bool_compare_and_swap(&_events[tid]._fd, 0, fd)) {
+    if (!__sync_bool_compare_and_swap(&event->_fd, 0, fd)) {
         // Lost race. The event is created either from start() or from onThreadStart()
         close(fd);
         return -1;
     }
 
-    void* page = mmap(NULL, 2 * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (_pmu_group) {
+        int err = openGroupCounters(event, fd, pid, cpu, flags, attr.exclude_kernel, attr.exclude_user);
+        if (err != 0) {
+            closeEvent(event);
+            return err;
+        }
+    }
+
+    void* page = mmap(NULL, (1 + _ring_pages) * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (page == MAP_FAILED) {
-        Log::warn("perf_event mmap failed: %s", strerror(errno));
+        int err = errno;
+        Log::warn("perf_event mmap failed: %s", strerror(err));
+        if (_native_only) {
+            // Without signals, samples are only ever read from the ring: the event would be useless
+            atomicInc(_ring_failures);
+            closeEvent(event);
+            return err;
+        }
         page = NULL;
     }
 
-    _events[tid].reset();
-    _events[tid]._page = (struct perf_event_mmap_page*)page;
+    event->reset();
+    event->_page = (struct perf_event_mmap_page*)page;
+
+    if (_native_only) {
+        // No signals: the kernel only writes samples to the ring buffer
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        return 0;
+    }
 
     struct f_owner_ex ex;
     ex.type = F_OWNER_TID;
-    ex.pid = tid;
+    ex.pid = pid;
 
     fcntl(fd, F_SETFL, O_ASYNC);
     fcntl(fd, F_SETSIG, SIGPROF);
@@ -580,25 +710,181 @@ int PerfEvents::createForThread(int tid) {
     return 0;
 }
 
-void PerfEvents::destroyForThread(int tid) {
-    if (tid >= _max_events) {
-        return;
+// Counting siblings start together with the disabled leader and are read with PERF_FORMAT_GROUP
+int PerfEvents::openGroupCounters(PerfEvent* event, int group_fd, int pid, int cpu, unsigned long flags,
+                                  bool exclude_kernel, bool exclude_user) {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_user = exclude_user;
+
+    for (int i = 0; i < MAX_GROUP_COUNTERS; i++) {
+        attr.config = GROUP_COUNTER_CONFIG[i];
+        int fd = syscall(__NR_perf_event_open, &attr, pid, cpu, group_fd, flags);
+        if (fd == -1) {
+            int err = errno;
+            Log::warn("perf_event_open failed for group counter: %s", strerror(errno));
+            return err;
+        }
+        event->_siblings[i] = fd;
     }
+    return 0;
+}
 
-    PerfEvent* event = &_events[tid];
+void PerfEvents::closeEvent(PerfEvent* event) {
     int fd = event->_fd;
     if (fd != 0 && __sync_bool_compare_and_swap(&event->_fd, fd, 0)) {
         ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
         close(fd);
     }
+    for (int i = 0; i < MAX_GROUP_COUNTERS; i++) {
+        int sibling = event->_siblings[i];
+        if (sibling != 0 && __sync_bool_compare_and_swap(&event->_siblings[i], sibling, 0)) {
+            close(sibling);
+        }
+    }
     if (event->_page != NULL) {
         event->lock();
-        munmap(event->_page, 2 * OS::page_size);
+        if (_native_only) {
+            // Samples of an exiting thread would be lost otherwise
+            drainBuffer(event);
+        }
+        munmap(event->_page, (1 + _ring_pages) * OS::page_size);
         event->_page = NULL;
         event->unlock();
     }
 }
 
+// Per-CPU events are scoped to the perf_event cgroup of the current process:
+// unlike pid with inheritance, it also covers threads that already exist
+int PerfEvents::openCgroup() {
+    FILE* f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    path[0] = 0;
+
+    char* line = NULL;
+    size_t len = 0;
+    while (getline(&line, &len, f) > 0) {
+        // hierarchy-ID:controller-list:cgroup-path
+        char* controllers = strchr(line, ':');
+        char* cgroup = controllers != NULL ? strchr(controllers + 1, ':') : NULL;
+        if (cgroup == NULL) {
+            continue;
+        }
+        *controllers++ = 0;
+        *cgroup++ = 0;
+        cgroup[strcspn(cgroup, "\n")] = 0;
+
+        if (strcmp(line, "0") == 0 && controllers[0] == 0) {
+            // cgroup v2 unified hierarchy; v1 perf_event controller takes precedence
+            if (path[0] == 0) {
+                snprintf(path, sizeof(path), "/sys/fs/cgroup%s", cgroup);
+            }
+        } else if (strstr(controllers, "perf_event") != NULL) {
+            snprintf(path, sizeof(path), "/sys/fs/cgroup/perf_event%s", cgroup);
+            break;
+        }
+    }
+
+    free(line);
+    fclose(f);
+
+    return path[0] == 0 ? -1 : open(path, O_RDONLY);
+}
+
+void PerfEvents::drainLoop() {
+    struct timespec delay = {0, DRAIN_INTERVAL};
+
+    while (_draining) {
+        nanosleep(&delay, NULL);
+
+        if (_per_cpu) {
+            for (int cpu = 0; cpu < _max_events; cpu++) {
+                PerfEvent* event = &_events[cpu];
+                if (event->tryLock()) {
+                    drainBuffer(event);
+                    event->unlock();
+                }
+            }
+            continue;
+        }
+
+        // Only threads with a live ring are visited, see trackRing()
+        for (int i = 0; i < _ring_tid_count; i++) {
+            PerfEvent* event = &_events[_ring_tids[i]];
+            if (event->tryLock()) {
+                drainBuffer(event);
+                event->unlock();
+            }
+        }
+    }
+}
+
+// Must be called with the event locked
+void PerfEvents::drainBuffer(PerfEvent* event) {
+    struct perf_event_mmap_page* page = event->_page;
+    if (page == NULL) {
+        return;
+    }
+
+    u64 tail = page->data_tail;
+    u64 head = page->data_head;
+    rmb();
+
+    RingBuffer ring(page, _ring_pages);
+    CodeCache* java_methods = Profiler::instance()->javaMethods();
+    CodeCache* runtime_stubs = Profiler::instance()->runtimeStubs();
+    bool enabled = _enabled;
+    int pid = getpid();
+
+    while (tail < head) {
+        struct perf_event_header* hdr = ring.seek(tail);
+        if (hdr->type == PERF_RECORD_SAMPLE && enabled) {
+            u64 pid_tid = ring.next();
+            const void* data_addr = _data_addr ? (const void*)ring.next() : NULL;
+            u64 nr = ring.next();
+
+            // A cgroup may contain other processes
+            if ((int)(u32)pid_tid != pid) {
+                tail += hdr->size;
+                continue;
+            }
+
+            const void* callchain[MAX_NATIVE_FRAMES];
+            int depth = 0;
+            bool java_truncated = false;
+
+            while (nr-- > 0 && depth < MAX_NATIVE_FRAMES) {
+                u64 ip = ring.next();
+                if (ip < PERF_CONTEXT_MAX) {
+                    const void* iptr = (const void*)ip;
+                    if (java_methods->contains(iptr) || runtime_stubs->contains(iptr)) {
+                        // Java frames cannot be resolved without stopping the thread
+                        java_truncated = true;
+                        break;
+                    }
+                    callchain[depth++] = iptr;
+                }
+            }
+
+            int tid = (int)(pid_tid >> 32);
+            Profiler::instance()->recordExternalSample(_interval, tid, depth, callchain, java_truncated, data_addr);
+        } else if (hdr->type == PERF_RECORD_LOST && enabled) {
+            ring.next();  // id
+            Profiler::instance()->recordLostSamples(ring.next());
+        }
+        tail += hdr->size;
+    }
+
+    __sync_synchronize();
+    page->data_tail = head;
+}
+
 void PerfEvents::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     if (siginfo->si_code <= 0) {
         // Looks like an external signal; don't treat as a profiling event
@@ -607,24 +893,40 @@ void PerfEvents::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
 
     if (_enabled) {
         u64 counter;
+        ExecutionEvent event;
+
+        // PERF_FORMAT_GROUP layout: nr, then the leader value followed by siblings
+        u64 group[2 + MAX_GROUP_COUNTERS];
+
         switch (_event_type->counter_arg) {
             case 1: counter = StackFrame(ucontext).arg0(); break;
             case 2: counter = StackFrame(ucontext).arg1(); break;
             case 3: counter = StackFrame(ucontext).arg2(); break;
             case 4: counter = StackFrame(ucontext).arg3(); break;
             default:
-                if (read(siginfo->si_fd, &counter, sizeof(counter)) != sizeof(counter)) {
+                if (_pmu_group) {
+                    if (read(siginfo->si_fd, group, sizeof(group)) == sizeof(group) && group[0] == 1 + MAX_GROUP_COUNTERS) {
+                        counter = group[1];
+                        event._group = group + 2;
+                    } else {
+                        counter = 1;
+                    }
+                } else if (read(siginfo->si_fd, &counter, sizeof(counter)) != sizeof(counter)) {
                     counter = 1;
                 }
         }
 
-        ExecutionEvent event;
+        if (_data_addr) {
+            event._data_addr = peekDataAddress(OS::threadId());
+        }
+
         Profiler::instance()->recordSample(ucontext, counter, 0, &event);
     } else {
         resetBuffer(OS::threadId());
     }
 
-    ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, 0);
+    // Counters of the group are reset together, so that every sample reads deltas
+    ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, _pmu_group ? PERF_IOC_FLAG_GROUP : 0);
     ioctl(siginfo->si_fd, PERF_EVENT_IOC_REFRESH, 1);
 }
 
@@ -715,43 +1017,123 @@ Error PerfEvents::start(Arguments& args) {
     }
     _cstack = args._cstack;
 
-    int max_events = OS::getMaxThreadId();
+    // Signals of a per-CPU event cannot be directed to the sampled thread
+    _per_cpu = args._per_cpu;
+    _native_only = args._native_only || _per_cpu;
+
+    _data_addr = args._data_addr;
+    if (_data_addr && _event_type->counter_arg > 0) {
+        return Error("Function arguments cannot be counted in dataaddr mode");
+    }
+
+    _pmu_group = args._pmu_group;
+    if (_pmu_group) {
+        if (_event_type->counter_arg > 0) {
+            return Error("Function arguments cannot be counted in pmugroup mode");
+        } else if (_native_only) {
+            return Error("pmugroup is not supported in nativeonly or percpu mode");
+        }
+    }
+
+    if (_native_only) {
+        if (_event_type->counter_arg > 0) {
+            return Error("Function arguments cannot be counted in nativeonly mode");
+        } else if (_cstack != CSTACK_DEFAULT) {
+            // Call stacks are collected by the kernel, there is no other way without a signal
+            return Error("cstack option is not supported in nativeonly mode");
+        }
+    }
+    _ring_pages = _per_cpu ? PER_CPU_RING_PAGES : _native_only ? NATIVE_ONLY_RING_PAGES : 1;
+
+    int cgroup_fd = -1;
+    if (_per_cpu && (cgroup_fd = openCgroup()) == -1) {
+        return Error("Cannot open perf_event cgroup of the process");
+    }
+
+    int max_events = _per_cpu ? (int)sysconf(_SC_NPROCESSORS_CONF) : OS::getMaxThreadId();
     if (max_events != _max_events) {
         free(_events);
         _events = (PerfEvent*)calloc(max_events, sizeof(PerfEvent));
+        free(_ring_tids);
+        _ring_tids = (int*)malloc(max_events * sizeof(int));
         _max_events = max_events;
     }
+    _ring_tid_count = 0;
+    _ring_failures = 0;
 
-    OS::installSignalHandler(SIGPROF, signalHandler);
+    if (!_native_only) {
+        OS::installSignalHandler(SIGPROF, signalHandler);
+    }
 
     // Enable thread events before traversing currently running threads
     Profiler::instance()->switchThreadEvents(JVMTI_ENABLE);
 
-    // Create perf_events for all existing threads
     int err;
     bool created = false;
-    ThreadList* thread_list = OS::listThreads();
-    for (int tid; (tid = thread_list->next()) != -1; ) {
-        if ((err = createForThread(tid)) == 0) {
-            created = true;
+    if (_per_cpu) {
+        // One event per CPU for the whole cgroup; offline CPUs are skipped
+        for (int cpu = 0; cpu < _max_events; cpu++) {
+            if ((err = openEvent(&_events[cpu], cgroup_fd, cpu, PERF_FLAG_PID_CGROUP)) == 0) {
+                created = true;
+            }
         }
+        close(cgroup_fd);
+    } else {
+        // Create perf_events for all existing threads
+        ThreadList* thread_list = OS::listThreads();
+        for (int tid; (tid = thread_list->next()) != -1; ) {
+            if ((err = createForThread(tid)) == 0) {
+                created = true;
+            }
+        }
+        delete thread_list;
     }
-    delete thread_list;
 
     if (!created) {
         Profiler::instance()->switchThreadEvents(JVMTI_DISABLE);
-        if (err == EACCES || err == EPERM) {
+        if ((err == EACCES || err == EPERM) && _per_cpu) {
+            // CPU-wide events are not relaxed by --all-user
+            return Error("No access to per-CPU perf events. Requires 'sysctl kernel.perf_event_paranoid=0', CAP_PERFMON or CAP_SYS_ADMIN");
+        } else if (err == EACCES || err == EPERM) {
             return Error("No access to perf events. Try --all-user option or 'sysctl kernel.perf_event_paranoid=1'");
         } else {
             return Error("Perf events unavailable");
         }
     }
+
+    if (_ring_failures > 0) {
+        // Samples of the threads without a ring would be silently lost
+        stop();
+        Profiler::instance()->switchThreadEvents(JVMTI_DISABLE);
+        return Error("Cannot map perf_event ring buffer. Check 'ulimit -l' and kernel.perf_event_mlock_kb");
+    }
+
+    if (_native_only) {
+        _draining = true;
+        if (pthread_create(&_drain_thread, NULL, drainThreadEntry, NULL) != 0) {
+            _draining = false;
+            stop();
+            Profiler::instance()->switchThreadEvents(JVMTI_DISABLE);
+            return Error("Unable to create drain thread");
+        }
+    }
     return Error::OK;
 }
 
 void PerfEvents::stop() {
+    if (_draining) {
+        _draining = false;
+        pthread_join(_drain_thread, NULL);
+    }
+
+    // Pending samples are drained while destroying the events
     for (int i = 0; i < _max_events; i++) {
-        destroyForThread(i);
+        closeEvent(&_events[i]);
+    }
+    _ring_tid_count = 0;
+
+    if (_ring_failures > 0) {
+        Log::warn("perf_event ring buffer could not be mapped for %d %s", _ring_failures, _per_cpu ? "CPUs" : "threads");
     }
 }
 
@@ -775,6 +1157,9 @@ int PerfEvents::getNativeTrace(void* ucontext, int tid, const void** callchain,
         while (tail < head) {
             struct perf_event_header* hdr = ring.seek(tail);
             if (hdr->type == PERF_RECORD_SAMPLE) {
+                if (_data_addr) {
+                    ring.next();  // consumed by signalHandler
+                }
                 u64 nr = ring.next();
                 while (nr-- > 0) {
                     u64 ip = ring.next();
@@ -828,6 +1213,37 @@ stack_complete:
     return depth;
 }
 
+// Finds the data address of the pending sample without consuming it; getNativeTrace does that later
+const void* PerfEvents::peekDataAddress(int tid) {
+    PerfEvent* event = &_events[tid];
+    if (!event->tryLock()) {
+        return NULL;  // the event is being destroyed
+    }
+
+    const void* address = NULL;
+
+    struct perf_event_mmap_page* page = event->_page;
+    if (page != NULL) {
+        u64 tail = page->data_tail;
+        u64 head = page->data_head;
+        rmb();
+
+        RingBuffer ring(page);
+
+        while (tail < head) {
+            struct perf_event_header* hdr = ring.seek(tail);
+            if (hdr->type == PERF_RECORD_SAMPLE) {
+                address = (const void*)ring.next();
+                break;
+            }
+            tail += hdr->size;
+        }
+    }
+
+    event->unlock();
+    return address;
+}
+
 void PerfEvents::resetBuffer(int tid) {
     PerfEvent* event = &_events[tid];
     if (!event->tryLock()) {
@@ -30,11 +30,14 @@
 #include "wallClock.h"
 #include "instrument.h"
 #include "itimer.h"
+#include "ctimer.h"
 #include "flameGraph.h"
 #include "flightRecorder.h"
 #include "frameName.h"
+#include "memoryUsage.h"
 #include "os.h"
 #include "stackFrame.h"
+#include "stackWalker.h"
 #include "symbols.h"
 #include "vmStructs.h"
 
@@ -49,8 +52,13 @@ static AllocTracer alloc_tracer;
 static LockTracer lock_tracer;
 static WallClock wall_clock;
 static ITimer itimer;
+static CTimer ctimer;
 static Instrument instrument;
 
+// How often to reclaim memory of superseded call trace tables
+static const u64 COMPACTION_INTERVAL = 1000000000;  // 1 second
+static const u64 SYMBOLS_LOAD_INTERVAL = 100000000;  // 100 ms
+
 
 // Stack recovery techniques used to workaround AsyncGetCallTrace flaws.
 // Can be disabled with 'safemode' option.
@@ -76,13 +84,20 @@ enum EventMask {
 struct MethodSample {
     u64 samples;
     u64 counter;
+    GroupCounters group;
 
-    void add(u64 add_samples, u64 add_counter) {
+    void add(u64 add_samples, u64 add_counter, const u64* add_group) {
         samples += add_samples;
         counter += add_counter;
+        if (add_group != NULL) group += add_group;
     }
 };
 
+static const u64* findGroupCounters(std::map<u32, GroupCounters>& map, CallTrace* trace) {
+    std::map<u32, GroupCounters>::const_iterator it = map.find(trace->id);
+    return it != map.end() ? it->second.values : NULL;
+}
+
 typedef std::pair<std::string, MethodSample> NamedMethodSample;
 
 static bool sortByCounter(const NamedMethodSample& a, const NamedMethodSample& b) {
@@ -90,10 +105,14 @@ static bool sortByCounter(const NamedMethodSample& a, const NamedMethodSample& b
 }
 
 
+// Signal handlers look up code caches without locking; the locks only serialize writers.
+// While the profiler is running, replaced blob arrays are freed by the compaction timer.
 void Profiler::addJavaMethod(const void* address, int length, jmethodID method) {
     _jit_lock.lock();
     _java_methods.add(address, length, method, true);
     _jit_lock.unlock();
+
+    if (_state != RUNNING) freeRetiredBlobs();
 }
 
 void Profiler::removeJavaMethod(const void* address, jmethodID method) {
@@ -106,12 +125,40 @@ void Profiler::resetJavaMethods() {
     _jit_lock.lock();
     _java_methods.reset();
     _jit_lock.unlock();
+
+    if (_state != RUNNING) freeRetiredBlobs();
 }
 
 void Profiler::addRuntimeStub(const void* address, int length, const char* name) {
     _stubs_lock.lock();
     _runtime_stubs.add(address, length, name, true);
     _stubs_lock.unlock();
+
+    if (_state != RUNNING) freeRetiredBlobs();
+}
+
+// Cycling through all spinlocks guarantees that signal handlers
+// which might still be looking at a replaced blob array have completed
+void Profiler::freeRetiredBlobs() {
+    _jit_lock.lock();
+    CodeBlobArray* java_methods = _java_methods.detachRetired();
+    _jit_lock.unlock();
+
+    _stubs_lock.lock();
+    CodeBlobArray* runtime_stubs = _runtime_stubs.detachRetired();
+    _stubs_lock.unlock();
+
+    if (java_methods == NULL && runtime_stubs == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        _locks[i].lock();
+        _locks[i].unlock();
+    }
+
+    CodeCache::freeArrays(java_methods);
+    CodeCache::freeArrays(runtime_stubs);
 }
 
 void Profiler::onThreadStart(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
@@ -121,6 +168,8 @@ void Profiler::onThreadStart(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
 
     if (_engine == &perf_events) {
         PerfEvents::createForThread(tid);
+    } else if (_engine == &ctimer) {
+        CTimer::createForThread(tid);
     }
 }
 
@@ -131,6 +180,8 @@ void Profiler::onThreadEnd(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
 
     if (_engine == &perf_events) {
         PerfEvents::destroyForThread(tid);
+    } else if (_engine == &ctimer) {
+        CTimer::destroyForThread(tid);
     }
 }
 
@@ -171,6 +222,7 @@ inline u32 Profiler::getLockIndex(int tid) {
 
 void Profiler::updateSymbols(bool kernel_symbols) {
     Symbols::parseLibraries(_native_libs, _native_lib_count, MAX_NATIVE_LIBS, kernel_symbols);
+    _native_lib_index.rebuild(_native_libs, _native_lib_count);
 }
 
 void Profiler::mangle(const char* name, char* buf, size_t size) {
@@ -200,16 +252,18 @@ const void* Profiler::resolveSymbol(const char* name) {
     }
 
     size_t len = strlen(name);
-    if (len > 0 && name[len - 1] == '*') {
+    bool prefix = len > 0 && name[len - 1] == '*';
+
+    // Searching a lazy library parses its symbols synchronously,
+    // so try libraries with symbols already loaded first
+    for (int pass = 0; pass < 2; pass++) {
         for (int i = 0; i < _native_lib_count; i++) {
-            const void* address = _native_libs[i]->findSymbolByPrefix(name, len - 1);
-            if (address != NULL) {
-                return address;
+            NativeCodeCache* lib = _native_libs[i];
+            if (lib->symbolsLoaded() != (pass == 0)) {
+                continue;
             }
-        }
-    } else {
-        for (int i = 0; i < _native_lib_count; i++) {
-            const void* address = _native_libs[i]->findSymbol(name);
+
+            const void* address = prefix ? lib->findSymbolByPrefix(name, len - 1) : lib->findSymbol(name);
             if (address != NULL) {
                 return address;
             }
@@ -219,9 +273,37 @@ const void* Profiler::resolveSymbol(const char* name) {
     return NULL;
 }
 
-NativeCodeCache* Profiler::findNativeLibrary(const void* address) {
+// Classifies a sampled data address by the memory region it belongs to. The class of a Java object
+// cannot be recovered, since the address may point anywhere inside the object.
+const char* Profiler::findDataRegion(const void* address) {
+    if (CollectedHeap::contains(address)) {
+        return "java_heap";
+    } else if (_java_methods.contains(address) || _runtime_stubs.contains(address)) {
+        return "code_cache";
+    }
+
     const int native_lib_count = _native_lib_count;
     for (int i = 0; i < native_lib_count; i++) {
+        if (_native_libs[i]->containsImage(address)) {
+            return _native_libs[i]->name();
+        }
+    }
+
+    // malloc heap, thread stacks, anonymous mappings
+    return "anon";
+}
+
+NativeCodeCache* Profiler::findNativeLibrary(const void* address) {
+    const int native_lib_count = _native_lib_count;
+
+    NativeCodeCache* lib;
+    int indexed = _native_lib_index.find(address, &lib);
+    if (lib != NULL && indexed >= 0) {
+        return lib;
+    }
+
+    // Libraries that are not in the index yet, or all of them if the index is being rebuilt
+    for (int i = indexed > 0 ? indexed : 0; i < native_lib_count; i++) {
         if (_native_libs[i]->contains(address)) {
             return _native_libs[i];
         }
@@ -243,9 +325,7 @@ bool Profiler::inJavaCode(void* ucontext) {
 
     const void* pc = (const void*)StackFrame(ucontext).pc();
     if (_runtime_stubs.contains(pc)) {
-        _stubs_lock.lockShared();
         jmethodID method = _runtime_stubs.find(pc);
-        _stubs_lock.unlockShared();
         return method == NULL || strcmp((const char*)method, "call_stub") != 0;
     }
     return _java_methods.contains(pc);
@@ -253,14 +333,29 @@ bool Profiler::inJavaCode(void* ucontext) {
 
 int Profiler::getNativeTrace(Engine* engine, void* ucontext, ASGCT_CallFrame* frames, int tid) {
     const void* native_callchain[MAX_NATIVE_FRAMES];
-    int native_frames = engine->getNativeTrace(ucontext, tid, native_callchain, MAX_NATIVE_FRAMES,
+    int native_frames;
+
+    if (_cstack == CSTACK_DWARF && ucontext != NULL) {
+        // perf_events still provides kernel frames, while user frames are unwound here
+        native_frames = engine == &perf_events
+            ? engine->getNativeTrace(ucontext, tid, native_callchain, MAX_NATIVE_FRAMES, &_java_methods, &_runtime_stubs)
+            : 0;
+        native_frames += StackWalker::walkDwarf(ucontext, native_callchain + native_frames, MAX_NATIVE_FRAMES - native_frames,
+                                                &_java_methods, &_runtime_stubs);
+    } else {
+        native_frames = engine->getNativeTrace(ucontext, tid, native_callchain, MAX_NATIVE_FRAMES,
                                                &_java_methods, &_runtime_stubs);
+    }
+
+    return convertNativeTrace(native_frames, native_callchain, frames);
+}
 
+int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames) {
     int depth = 0;
     jmethodID prev_method = NULL;
 
     for (int i = 0; i < native_frames; i++) {
-        jmethodID current_method = (jmethodID)findNativeMethod(native_callchain[i]);
+        jmethodID current_method = (jmethodID)findNativeMethod(callchain[i]);
         if (current_method == prev_method && _cstack == CSTACK_LBR) {
             // Skip duplicates in LBR stack, where branch_stack[N].from == branch_stack[N+1].to
             prev_method = NULL;
@@ -505,26 +600,20 @@ bool Profiler::fillTopFrame(const void* pc, ASGCT_CallFrame* frame) {
     jmethodID method = NULL;
 
     // Check if PC belongs to a JIT compiled method
-    _jit_lock.lockShared();
     if (_java_methods.contains(pc) && (method = _java_methods.find(pc)) != NULL) {
         frame->bci = 0;
         frame->method_id = method;
-    }
-    _jit_lock.unlockShared();
-
-    if (method != NULL) {
         return true;
     }
 
     // Check if PC belongs to a VM runtime stub
-    _stubs_lock.lockShared();
     if (_runtime_stubs.contains(pc) && (method = _runtime_stubs.find(pc)) != NULL) {
         frame->bci = BCI_NATIVE_FRAME;
         frame->method_id = method;
+        return true;
     }
-    _stubs_lock.unlockShared();
 
-    return method != NULL;
+    return false;
 }
 
 AddressType Profiler::getAddressType(instruction_t* pc) {
@@ -532,9 +621,7 @@ AddressType Profiler::getAddressType(instruction_t* pc) {
 
     // 1. Check if PC lies within JVM's compiled code cache
     if (_java_methods.contains(pc)) {
-        _jit_lock.lockShared();
         jmethodID method = _java_methods.find(pc);
-        _jit_lock.unlockShared();
         if (method != NULL) {
             return ADDR_JIT;
         }
@@ -543,9 +630,7 @@ AddressType Profiler::getAddressType(instruction_t* pc) {
 
     // 2. The same for VM runtime stubs
     if (_runtime_stubs.contains(pc)) {
-        _stubs_lock.lockShared();
         jmethodID method = _runtime_stubs.find(pc);
-        _stubs_lock.unlockShared();
         if (method != NULL) {
             return ADDR_STUB;
         }
@@ -553,13 +638,8 @@ AddressType Profiler::getAddressType(instruction_t* pc) {
     }
 
     // 3. Check if PC belongs to executable code of shared libraries
-    if (!in_generated_code) {
-        const int native_lib_count = _native_lib_count;
-        for (int i = 0; i < native_lib_count; i++) {
-            if (_native_libs[i]->contains(pc)) {
-                return ADDR_NATIVE;
-            }
-        }
+    if (!in_generated_code && findNativeLibrary(pc) != NULL) {
+        return ADDR_NATIVE;
     }
 
     // This can be some other dynamically generated code, but we don't know it. Better stay safe.
@@ -591,6 +671,8 @@ void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event*
     int num_frames = 0;
     if (!_jfr.active() && event_type <= BCI_ALLOC && event_type >= BCI_PARK && event->id()) {
         num_frames = makeEventFrame(frames, event_type, event->id());
+    } else if (event_type == 0 && ((ExecutionEvent*)event)->_data_addr != NULL) {
+        num_frames = makeEventFrame(frames, BCI_DATA, (uintptr_t)findDataRegion(((ExecutionEvent*)event)->_data_addr));
     }
 
     // Use engine stack walker for execution samples, or basic stack walker for other events
@@ -628,12 +710,61 @@ void Profiler::recordSample(void* ucontext, u64 counter, jint event_type, Event*
         num_frames += makeEventFrame(frames + num_frames, BCI_THREAD_ID, tid);
     }
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
+    const u64* group = event_type == 0 ? ((ExecutionEvent*)event)->_group : NULL;
+    u32 call_trace_id = _call_trace_storage->put(num_frames, frames, counter, lock_index, group);
     _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event, counter);
 
     _locks[lock_index].unlock();
 }
 
+// Records an execution sample taken without interrupting the thread, e.g. read from a perf ring buffer.
+// Only native frames are known; if the stack continues into Java code, it is marked with a [java] frame.
+void Profiler::recordExternalSample(u64 counter, int tid, int num_frames, const void** callchain, bool java_truncated,
+                                    const void* data_addr) {
+    atomicInc(_total_samples);
+
+    u32 lock_index = getLockIndex(tid);
+    if (!_locks[lock_index].tryLock() &&
+        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
+        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
+    {
+        atomicInc(_failures[-ticks_skipped]);
+        return;
+    }
+
+    ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
+    if (num_frames > MAX_NATIVE_FRAMES) {
+        num_frames = MAX_NATIVE_FRAMES;
+    }
+
+    int data_frames = 0;
+    if (data_addr != NULL) {
+        data_frames = makeEventFrame(frames, BCI_DATA, (uintptr_t)findDataRegion(data_addr));
+    }
+    num_frames = data_frames + convertNativeTrace(num_frames, callchain, frames + data_frames);
+
+    if (java_truncated) {
+        num_frames += makeEventFrame(frames + num_frames, BCI_ERROR, (uintptr_t)"java");
+    } else if (num_frames == data_frames) {
+        num_frames += makeEventFrame(frames + num_frames, BCI_ERROR, (uintptr_t)"no_native_frame");
+    }
+
+    if (_add_thread_frame) {
+        num_frames += makeEventFrame(frames + num_frames, BCI_THREAD_ID, tid);
+    }
+
+    ExecutionEvent event;
+    u32 call_trace_id = _call_trace_storage->put(num_frames, frames, counter, lock_index);
+    _jfr.recordEvent(lock_index, tid, call_trace_id, 0, &event, counter);
+
+    _locks[lock_index].unlock();
+}
+
+void Profiler::recordLostSamples(u64 count) {
+    atomicInc(_total_samples, count);
+    atomicInc(_failures[-ticks_skipped], count);
+}
+
 void Profiler::writeLog(LogLevel level, const char* message) {
     _jfr.recordLog(level, message, strlen(message));
 }
@@ -886,6 +1017,8 @@ Engine* Profiler::selectEngine(const char* event_name) {
         return &wall_clock;
     } else if (strcmp(event_name, EVENT_ITIMER) == 0) {
         return &itimer;
+    } else if (strcmp(event_name, EVENT_CTIMER) == 0) {
+        return &ctimer;
     } else if (strchr(event_name, '.') != NULL && strchr(event_name, ':') == NULL) {
         return &instrument;
     } else {
@@ -940,6 +1073,18 @@ Error Profiler::start(Arguments& args, bool reset) {
         return Error("Only JFR output supports multiple events");
     }
 
+    // Samples are recorded under one of CONCURRENCY_LEVEL locks, so each lock owns a shard
+    _use_huge_pages = args._hugepages;
+    _memlimit = args._memlimit;
+    _call_trace_storage->setShards(args._sharded ? CONCURRENCY_LEVEL : 0);
+    _call_trace_storage->setMemLimit(args._memlimit);
+    _call_trace_storage->setTrie(args._trie);
+    _call_trace_storage->setHugePages(args._hugepages);
+    _call_trace_storage->setGroupCounters(args._pmu_group ? MAX_GROUP_COUNTERS : 0);
+    if (_spare_storage != NULL) {
+        shareMemLimit(_call_trace_storage, spareStorage());
+    }
+
     if (reset || _start_time == 0) {
         // Reset counters
         _total_samples = 0;
@@ -948,7 +1093,7 @@ Error Profiler::start(Arguments& args, bool reset) {
         // Reset dicrionaries and bitmaps
         _class_map.clear();
         _thread_filter.clear();
-        _call_trace_storage.clear();
+        _call_trace_storage->clear();
 
         // Reset thread names and IDs
         MutexLocker ml(_thread_names_lock);
@@ -987,6 +1132,13 @@ Error Profiler::start(Arguments& args, bool reset) {
     _cstack = args._cstack;
     if (_cstack == CSTACK_LBR && _engine != &perf_events) {
         return Error("Branch stack is supported only with PMU events");
+    } else if ((args._native_only || args._per_cpu || args._pmu_group || args._data_addr) && _engine != &perf_events) {
+        return Error("nativeonly, percpu, pmugroup and dataaddr modes are supported only with perf_events");
+    } else if (_cstack == CSTACK_DWARF) {
+        if (!DWARF_SUPPORTED) {
+            return Error("DWARF unwinding is not supported on this platform");
+        }
+        Symbols::enableUnwindTables(_native_libs, _native_lib_count);
     }
 
     error = installTraps(args._begin, args._end);
@@ -1026,6 +1178,11 @@ Error Profiler::start(Arguments& args, bool reset) {
     // Thread events might be already enabled by PerfEvents::start
     switchThreadEvents(JVMTI_ENABLE);
 
+    _compaction_timer = OS::startTimer(COMPACTION_INTERVAL, compactionCallback, this);
+    if (Symbols::isLazy()) {
+        _symbols_timer = OS::startTimer(SYMBOLS_LOAD_INTERVAL, symbolsCallback, this);
+    }
+
     _state = RUNNING;
     _start_time = time(NULL);
     return Error::OK;
@@ -1053,6 +1210,15 @@ Error Profiler::stop() {
 
     uninstallTraps();
 
+    if (_compaction_timer != NULL) {
+        OS::stopTimer(_compaction_timer);
+        _compaction_timer = NULL;
+    }
+    if (_symbols_timer != NULL) {
+        OS::stopTimer(_symbols_timer);
+        _symbols_timer = NULL;
+    }
+
     if (_event_mask & EM_LOCK) lock_tracer.stop();
     if (_event_mask & EM_ALLOC) alloc_tracer.stop();
 
@@ -1069,9 +1235,45 @@ Error Profiler::stop() {
     for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].unlock();
 
     _state = IDLE;
+    freeRetiredBlobs();
     return Error::OK;
 }
 
+// Libraries registered lazily get their symbols once a sample hits them
+void Profiler::loadRequestedSymbols() {
+    const int native_lib_count = _native_lib_count;
+    for (int i = 0; i < native_lib_count; i++) {
+        NativeCodeCache* lib = _native_libs[i];
+        if (lib->symbolsRequested() && !lib->symbolsLoaded()) {
+            Symbols::loadSymbols(lib);
+        }
+    }
+}
+
+// Periodically reclaims hash tables superseded after CallTraceStorage growth.
+// Cycling through all spinlocks guarantees that signal handlers
+// which might have seen the old state of the storage have completed.
+void Profiler::compactCallTraces() {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING || !_call_trace_storage->startCompaction()) {
+        return;
+    }
+
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        _locks[i].lock();
+        _locks[i].unlock();
+    }
+
+    _call_trace_storage->migrate();
+
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        _locks[i].lock();
+        _locks[i].unlock();
+    }
+
+    _call_trace_storage->finishCompaction();
+}
+
 Error Profiler::check(Arguments& args) {
     MutexLocker ml(_state_lock);
     if (_state != IDLE) {
@@ -1104,40 +1306,99 @@ void Profiler::switchThreadEvents(jvmtiEventMode mode) {
 }
 
 void Profiler::dump(std::ostream& out, Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state != IDLE || _engine == NULL) return;
+
+    dump(out, args, _call_trace_storage, _total_samples, _failures);
+}
+
+void Profiler::dump(std::ostream& out, Arguments& args, CallTraceStorage* storage, u64 total_samples, const u64* failures) {
     switch (args._output) {
         case OUTPUT_COLLAPSED:
-            dumpCollapsed(out, args);
+            dumpCollapsed(out, args, storage);
             break;
         case OUTPUT_FLAMEGRAPH:
-            dumpFlameGraph(out, args, false);
+            dumpFlameGraph(out, args, storage, false);
             break;
         case OUTPUT_TREE:
-            dumpFlameGraph(out, args, true);
+            dumpFlameGraph(out, args, storage, true);
             break;
         case OUTPUT_TEXT:
-            dumpText(out, args);
+            dumpText(out, args, storage, total_samples, failures);
             break;
         default:
             break;
     }
 }
 
+// Dumps the profile collected so far without stopping the profiler.
+// Signal handlers switch to the spare storage, while the previous one is dumped and recycled.
+Error Profiler::snapshot(std::ostream& out, Arguments& args) {
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        return Error("Profiler is not active");
+    } else if (args._output == OUTPUT_JFR || _jfr.active()) {
+        return Error("Snapshots are not supported with JFR output");
+    }
+
+    if (_spare_storage == NULL) {
+        _spare_storage = new CallTraceStorage();
+    }
+
+    CallTraceStorage* storage = _call_trace_storage;
+    CallTraceStorage* spare = spareStorage();
+    spare->configureAs(storage);
+    spare->clear();
+    shareMemLimit(spare, storage);
+
+    // Counters of the dumped generation; samples counted from now on belong to the new one
+    u64 total_samples = _total_samples;
+    u64 failures[ASGCT_FAILURE_TYPES];
+    memcpy(failures, _failures, sizeof(failures));
+
+    _call_trace_storage = spare;
+
+    // Wait until signal handlers, which might have seen the old storage, complete
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        _locks[i].lock();
+        _locks[i].unlock();
+    }
+
+    dump(out, args, storage, total_samples, failures);
+
+    atomicInc(_total_samples, -total_samples);
+    for (int i = 0; i < ASGCT_FAILURE_TYPES; i++) {
+        atomicInc(_failures[i], -failures[i]);
+    }
+
+    storage->clear();
+    shareMemLimit(spare, storage);
+    return Error::OK;
+}
+
+// Both storage generations are covered by one memory limit:
+// the active storage may use whatever the idle one does not hold
+void Profiler::shareMemLimit(CallTraceStorage* active, CallTraceStorage* idle) {
+    if (_memlimit > 0) {
+        size_t idle_memory = idle->usedMemory();
+        active->setMemLimit(idle_memory < _memlimit ? _memlimit - idle_memory : 1);
+    }
+}
+
 /*
  * Dump stacks in FlameGraph input format:
  * 
  * <frame>;<frame>;...;<topmost frame> <count>
  */
-void Profiler::dumpCollapsed(std::ostream& out, Arguments& args) {
-    MutexLocker ml(_state_lock);
-    if (_state != IDLE || _engine == NULL) return;
-
+void Profiler::dumpCollapsed(std::ostream& out, Arguments& args, CallTraceStorage* storage) {
     FrameName fn(args, args._style, _thread_names_lock, _thread_names);
+    TraceExpander expander;
 
     std::vector<CallTraceSample*> samples;
-    _call_trace_storage.collectSamples(samples);
+    storage->collectSamples(samples);
 
     for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-        CallTrace* trace = (*it)->trace;
+        CallTrace* trace = expander.expand((*it)->trace);
         if (excludeTrace(&fn, trace)) continue;
 
         for (int j = trace->num_frames - 1; j >= 0; j--) {
@@ -1148,10 +1409,7 @@ void Profiler::dumpCollapsed(std::ostream& out, Arguments& args) {
     }
 }
 
-void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
-    MutexLocker ml(_state_lock);
-    if (_state != IDLE || _engine == NULL) return;
-
+void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, CallTraceStorage* storage, bool tree) {
     char title[64];
     if (args._title == NULL) {
         Engine* active_engine = activeEngine();
@@ -1164,15 +1422,20 @@ void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
 
     FlameGraph flamegraph(args._title == NULL ? title : args._title, args._counter, args._minwidth, args._reverse);
     FrameName fn(args, args._style, _thread_names_lock, _thread_names);
+    TraceExpander expander;
 
     std::vector<CallTraceSample*> samples;
-    _call_trace_storage.collectSamples(samples);
+    storage->collectSamples(samples);
+
+    std::map<u32, GroupCounters> groups;
+    storage->collectGroupCounters(groups);
 
     for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-        CallTrace* trace = (*it)->trace;
+        CallTrace* trace = expander.expand((*it)->trace);
         if (excludeTrace(&fn, trace)) continue;
 
         u64 samples = (args._counter == COUNTER_SAMPLES ? (*it)->samples : (*it)->counter);
+        const u64* group = findGroupCounters(groups, trace);
         int num_frames = trace->num_frames;
 
         Trie* f = flamegraph.root();
@@ -1181,42 +1444,44 @@ void Profiler::dumpFlameGraph(std::ostream& out, Arguments& args, bool tree) {
                 // Thread frames always come first
                 num_frames--;
                 const char* frame_name = fn.name(trace->frames[num_frames]);
-                f = f->addChild(frame_name, samples);
+                f = f->addChild(frame_name, samples, group);
             }
 
             for (int j = 0; j < num_frames; j++) {
                 const char* frame_name = fn.name(trace->frames[j]);
-                f = f->addChild(frame_name, samples);
+                f = f->addChild(frame_name, samples, group);
             }
         } else {
             for (int j = num_frames - 1; j >= 0; j--) {
                 const char* frame_name = fn.name(trace->frames[j]);
-                f = f->addChild(frame_name, samples);
+                f = f->addChild(frame_name, samples, group);
             }
         }
-        f->addLeaf(samples);
+        f->addLeaf(samples, group);
     }
 
     flamegraph.dump(out, tree);
 }
 
-void Profiler::dumpText(std::ostream& out, Arguments& args) {
-    MutexLocker ml(_state_lock);
-    if (_state != IDLE || _engine == NULL) return;
-
+void Profiler::dumpText(std::ostream& out, Arguments& args, CallTraceStorage* storage, u64 total_samples, const u64* failures) {
     FrameName fn(args, args._style | STYLE_DOTTED, _thread_names_lock, _thread_names);
+    TraceExpander expander;
     char buf[1024] = {0};
 
     std::vector<CallTraceSample> samples;
     u64 total_counter = 0;
+
+    std::map<u32, GroupCounters> groups;
+    storage->collectGroupCounters(groups);
+    char info[128];
     {
         std::map<u64, CallTraceSample> map;
-        _call_trace_storage.collectSamples(map);
+        storage->collectSamples(map);
         samples.reserve(map.size());
 
         for (std::map<u64, CallTraceSample>::const_iterator it = map.begin(); it != map.end(); ++it) {
             total_counter += it->second.counter;
-            CallTrace* trace = it->second.trace;
+            CallTrace* trace = expander.expand(it->second.trace);
             if (trace->num_frames == 0 || excludeTrace(&fn, trace)) continue;
             samples.push_back(it->second);
         }
@@ -1226,14 +1491,14 @@ void Profiler::dumpText(std::ostream& out, Arguments& args) {
     snprintf(buf, sizeof(buf) - 1,
             "--- Execution profile ---\n"
             "Total samples       : %lld\n",
-            _total_samples);
+            total_samples);
     out << buf;
 
-    double spercent = 100.0 / _total_samples;
+    double spercent = 100.0 / total_samples;
     for (int i = 1; i < ASGCT_FAILURE_TYPES; i++) {
         const char* err_string = asgctError(-i);
-        if (err_string != NULL && _failures[i] > 0) {
-            snprintf(buf, sizeof(buf), "%-20s: %lld (%.2f%%)\n", err_string, _failures[i], _failures[i] * spercent);
+        if (err_string != NULL && failures[i] > 0) {
+            snprintf(buf, sizeof(buf), "%-20s: %lld (%.2f%%)\n", err_string, failures[i], failures[i] * spercent);
             out << buf;
         }
     }
@@ -1248,12 +1513,19 @@ void Profiler::dumpText(std::ostream& out, Arguments& args) {
 
         int max_count = args._dump_traces;
         for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.end() && --max_count >= 0; ++it) {
-            snprintf(buf, sizeof(buf) - 1, "--- %lld %s (%.2f%%), %lld sample%s\n",
-                     it->counter, units_str, it->counter * cpercent,
-                     it->samples, it->samples == 1 ? "" : "s");
+            const u64* group = findGroupCounters(groups, it->trace);
+            if (group != NULL && GroupCounters::format(info, sizeof(info), group) > 0) {
+                snprintf(buf, sizeof(buf) - 1, "--- %lld %s (%.2f%%), %lld sample%s, %s\n",
+                         it->counter, units_str, it->counter * cpercent,
+                         it->samples, it->samples == 1 ? "" : "s", info);
+            } else {
+                snprintf(buf, sizeof(buf) - 1, "--- %lld %s (%.2f%%), %lld sample%s\n",
+                         it->counter, units_str, it->counter * cpercent,
+                         it->samples, it->samples == 1 ? "" : "s");
+            }
             out << buf;
 
-            CallTrace* trace = it->trace;
+            CallTrace* trace = expander.expand(it->trace);
             for (int j = 0; j < trace->num_frames; j++) {
                 const char* frame_name = fn.name(trace->frames[j]);
                 snprintf(buf, sizeof(buf) - 1, "  [%2d] %s\n", j, frame_name);
@@ -1267,8 +1539,8 @@ void Profiler::dumpText(std::ostream& out, Arguments& args) {
     if (args._dump_flat > 0) {
         std::map<std::string, MethodSample> histogram;
         for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-            const char* frame_name = fn.name(it->trace->frames[0]);
-            histogram[frame_name].add(it->samples, it->counter);
+            const char* frame_name = fn.name(expander.expand(it->trace)->frames[0]);
+            histogram[frame_name].add(it->samples, it->counter, findGroupCounters(groups, it->trace));
         }
 
         std::vector<NamedMethodSample> methods(histogram.begin(), histogram.end());
@@ -1280,13 +1552,42 @@ void Profiler::dumpText(std::ostream& out, Arguments& args) {
 
         int max_count = args._dump_flat;
         for (std::vector<NamedMethodSample>::const_iterator it = methods.begin(); it != methods.end() && --max_count >= 0; ++it) {
-            snprintf(buf, sizeof(buf) - 1, "%12lld  %6.2f%%  %7lld  %s\n",
-                     it->second.counter, it->second.counter * cpercent, it->second.samples, it->first.c_str());
+            if (GroupCounters::format(info, sizeof(info), it->second.group.values) > 0) {
+                snprintf(buf, sizeof(buf) - 1, "%12lld  %6.2f%%  %7lld  %s (%s)\n",
+                         it->second.counter, it->second.counter * cpercent, it->second.samples, it->first.c_str(), info);
+            } else {
+                snprintf(buf, sizeof(buf) - 1, "%12lld  %6.2f%%  %7lld  %s\n",
+                         it->second.counter, it->second.counter * cpercent, it->second.samples, it->first.c_str());
+            }
             out << buf;
         }
     }
 }
 
+void Profiler::printMemoryUsage(std::ostream& out) {
+    char buf[128];
+    out << "Profiler memory usage:" << std::endl;
+    for (int i = 0; i < MEM_CATEGORIES; i++) {
+        MemoryCategory category = (MemoryCategory)i;
+        snprintf(buf, sizeof(buf) - 1, "  %-20s %10llu KB  %10llu objects\n", MemoryUsage::CATEGORY_NAME[i],
+                 MemoryUsage::bytes(category) >> 10, MemoryUsage::objects(category));
+        out << buf;
+    }
+    snprintf(buf, sizeof(buf) - 1, "  %-20s %10llu KB\n", "total", MemoryUsage::totalBytes() >> 10);
+    out << buf;
+}
+
+static const char* hugePagesName(HugePages huge_pages) {
+    switch (huge_pages) {
+        case HUGE_PAGES_THP:
+            return "MADV_HUGEPAGE";
+        case HUGE_PAGES_HUGETLB:
+            return "MAP_HUGETLB";
+        default:
+            return "none";
+    }
+}
+
 Error Profiler::runInternal(Arguments& args, std::ostream& out) {
     switch (args._action) {
         case ACTION_START:
@@ -1318,11 +1619,24 @@ Error Profiler::runInternal(Arguments& args, std::ostream& out) {
             MutexLocker ml(_state_lock);
             if (_state == RUNNING) {
                 out << "Profiling is running for " << uptime() << " seconds" << std::endl;
+                if (_call_trace_storage->memLimit() > 0) {
+                    out << "Call trace storage: " << (_call_trace_storage->usedMemory() >> 10) << " of "
+                        << (_call_trace_storage->memLimit() >> 10) << " KB used, "
+                        << _call_trace_storage->evictedSamples() << " samples evicted" << std::endl;
+                }
+                if (_use_huge_pages) {
+                    out << "Huge pages: call trace table - " << hugePagesName(_call_trace_storage->tableHugePages())
+                        << ", call trace chunks - " << hugePagesName(_call_trace_storage->chunkHugePages()) << std::endl;
+                }
             } else {
                 out << "Profiler is not active" << std::endl;
             }
+            printMemoryUsage(out);
             break;
         }
+        case ACTION_MEMINFO:
+            printMemoryUsage(out);
+            break;
         case ACTION_LIST: {
             out << "Basic events:" << std::endl;
             out << "  " << EVENT_CPU << std::endl;
@@ -1330,6 +1644,7 @@ Error Profiler::runInternal(Arguments& args, std::ostream& out) {
             out << "  " << EVENT_LOCK << std::endl;
             out << "  " << EVENT_WALL << std::endl;
             out << "  " << EVENT_ITIMER << std::endl;
+            out << "  " << EVENT_CTIMER << std::endl;
 
             out << "Java method calls:" << std::endl;
             out << "  ClassName.methodName" << std::endl;
@@ -1356,6 +1671,13 @@ Error Profiler::runInternal(Arguments& args, std::ostream& out) {
             stop();
             dump(out, args);
             break;
+        case ACTION_SNAPSHOT: {
+            Error error = snapshot(out, args);
+            if (error) {
+                return error;
+            }
+            break;
+        }
         default:
             break;
     }
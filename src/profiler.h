@@ -30,6 +30,7 @@
 #include "flightRecorder.h"
 #include "log.h"
 #include "mutex.h"
+#include "os.h"
 #include "spinLock.h"
 #include "threadFilter.h"
 #include "trap.h"
@@ -81,7 +82,11 @@ class Profiler {
     Dictionary _class_map;
     Dictionary _symbol_map;
     ThreadFilter _thread_filter;
-    CallTraceStorage _call_trace_storage;
+    // Storage generations: one is being filled, while the other is either idle or being dumped.
+    // The spare one is allocated on the first snapshot.
+    CallTraceStorage _storage;
+    CallTraceStorage* _spare_storage;
+    CallTraceStorage* volatile _call_trace_storage;
     FlightRecorder _jfr;
     Engine* _engine;
     int _event_mask;
@@ -90,13 +95,18 @@ class Profiler {
     u64 _total_samples;
     u64 _failures[ASGCT_FAILURE_TYPES];
 
+    Timer* _compaction_timer;
+    Timer* _symbols_timer;
+
     SpinLock _locks[CONCURRENCY_LEVEL];
     CallTraceBuffer* _calltrace_buffer[CONCURRENCY_LEVEL];
     int _max_stack_depth;
     int _safe_mode;
     CStack _cstack;
     bool _add_thread_frame;
+    bool _use_huge_pages;
     bool _update_thread_names;
+    size_t _memlimit;
     volatile bool _thread_events_state;
 
     SpinLock _jit_lock;
@@ -105,6 +115,7 @@ class Profiler {
     NativeCodeCache _runtime_stubs;
     NativeCodeCache* _native_libs[MAX_NATIVE_LIBS];
     volatile int _native_lib_count;
+    NativeLibraryIndex _native_lib_index;
 
     // Support for intercepting NativeLibrary.load() / NativeLibraries.load()
     JNINativeMethod _load_method;
@@ -136,6 +147,7 @@ class Profiler {
     u32 getLockIndex(int tid);
     bool inJavaCode(void* ucontext);
     int getNativeTrace(Engine* engine, void* ucontext, ASGCT_CallFrame* frames, int tid);
+    int convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames);
     int getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth);
     int getJavaTraceJvmti(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int start_depth, int max_depth);
     int getJavaTraceInternal(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int max_depth);
@@ -152,6 +164,25 @@ class Profiler {
     Engine* selectEngine(const char* event_name);
     Engine* activeEngine();
     Error checkJvmCapabilities();
+    void compactCallTraces();
+    void shareMemLimit(CallTraceStorage* active, CallTraceStorage* idle);
+
+    CallTraceStorage* spareStorage() {
+        return _call_trace_storage == &_storage ? _spare_storage : &_storage;
+    }
+
+    void freeRetiredBlobs();
+
+    static void compactionCallback(void* arg) {
+        ((Profiler*)arg)->compactCallTraces();
+        ((Profiler*)arg)->freeRetiredBlobs();
+    }
+
+    void loadRequestedSymbols();
+
+    static void symbolsCallback(void* arg) {
+        ((Profiler*)arg)->loadRequestedSymbols();
+    }
 
     static Profiler* const _instance;
 
@@ -161,17 +192,23 @@ class Profiler {
         _begin_trap(2),
         _end_trap(3),
         _thread_filter(),
-        _call_trace_storage(),
+        _spare_storage(NULL),
+        _call_trace_storage(&_storage),
         _jfr(),
         _start_time(0),
+        _compaction_timer(NULL),
+        _symbols_timer(NULL),
         _max_stack_depth(0),
         _safe_mode(0),
+        _use_huge_pages(false),
+        _memlimit(0),
         _thread_events_state(JVMTI_DISABLE),
         _jit_lock(),
         _stubs_lock(),
         _java_methods(),
         _runtime_stubs("[stubs]"),
         _native_lib_count(0),
+        _native_lib_index(MAX_NATIVE_LIBS),
         _original_NativeLibrary_load(NULL) {
 
         for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
@@ -188,6 +225,8 @@ class Profiler {
 
     Dictionary* classMap() { return &_class_map; }
     ThreadFilter* threadFilter() { return &_thread_filter; }
+    CodeCache* javaMethods() { return &_java_methods; }
+    CodeCache* runtimeStubs() { return &_runtime_stubs; }
 
     Error run(Arguments& args);
     Error runInternal(Arguments& args, std::ostream& out);
@@ -197,16 +236,23 @@ class Profiler {
     Error stop();
     void switchThreadEvents(jvmtiEventMode mode);
     void dump(std::ostream& out, Arguments& args);
-    void dumpCollapsed(std::ostream& out, Arguments& args);
-    void dumpFlameGraph(std::ostream& out, Arguments& args, bool tree);
-    void dumpText(std::ostream& out, Arguments& args);
+    void dump(std::ostream& out, Arguments& args, CallTraceStorage* storage, u64 total_samples, const u64* failures);
+    Error snapshot(std::ostream& out, Arguments& args);
+    void dumpCollapsed(std::ostream& out, Arguments& args, CallTraceStorage* storage);
+    void dumpFlameGraph(std::ostream& out, Arguments& args, CallTraceStorage* storage, bool tree);
+    void dumpText(std::ostream& out, Arguments& args, CallTraceStorage* storage, u64 total_samples, const u64* failures);
+    void printMemoryUsage(std::ostream& out);
     void recordSample(void* ucontext, u64 counter, jint event_type, Event* event);
+    void recordExternalSample(u64 counter, int tid, int num_frames, const void** callchain, bool java_truncated,
+                              const void* data_addr);
+    void recordLostSamples(u64 count);
     void writeLog(LogLevel level, const char* message);
     void writeLog(LogLevel level, const char* message, size_t len);
 
     void updateSymbols(bool kernel_symbols);
     const void* resolveSymbol(const char* name);
     NativeCodeCache* findNativeLibrary(const void* address);
+    const char* findDataRegion(const void* address);
     const char* findNativeMethod(const void* address);
     void resetJavaMethods();
 
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "stackWalker.h"
+#include "dwarf.h"
+#include "profiler.h"
+#include "stackFrame.h"
+
+
+const uintptr_t MAX_WALK_SIZE = 0x100000;
+const uintptr_t MAX_FRAME_SIZE = 0x40000;
+
+int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth,
+                           CodeCache* java_methods, CodeCache* runtime_stubs) {
+    StackFrame frame(ucontext);
+    const void* pc = (const void*)frame.pc();
+    uintptr_t sp = frame.sp();
+    uintptr_t fp = frame.fp();
+    uintptr_t bottom = (uintptr_t)&sp + MAX_WALK_SIZE;
+
+    Profiler* profiler = Profiler::instance();
+    int depth = 0;
+    const void* const valid_pc = (const void* const)0x1000;
+
+    // Walk until the bottom of the stack or until the first Java frame
+    while (depth < max_depth && pc >= valid_pc) {
+        if (java_methods->contains(pc) || runtime_stubs->contains(pc)) {
+            break;
+        }
+
+        callchain[depth++] = pc;
+
+        // Return address may point right past the function, if it ends with a call
+        const void* lookup_pc = depth > 1 ? (const char*)pc - 1 : pc;
+        NativeCodeCache* lib = profiler->findNativeLibrary(lookup_pc);
+        const FrameDesc* f = lib != NULL ? lib->findFrameDesc(lookup_pc) : NULL;
+        if (f == NULL) {
+            f = &FrameDesc::default_frame;
+        }
+
+        uintptr_t cfa;
+        int cfa_off = f->cfaOff();
+        switch (f->cfaReg()) {
+            case DW_REG_SP:
+                cfa = sp + cfa_off;
+                break;
+            case DW_REG_FP:
+                cfa = fp + cfa_off;
+                break;
+            case DW_REG_PLT:
+                cfa = sp + cfa_off + (((uintptr_t)pc & 15) >= 11 ? EMPTY_FRAME_SIZE : 0);
+                break;
+            default:
+                return depth;
+        }
+
+        // CFA must be above the current frame on the same stack, and be word aligned
+        if (cfa <= sp || cfa - sp >= MAX_FRAME_SIZE || cfa >= bottom || (cfa & (sizeof(uintptr_t) - 1)) != 0) {
+            break;
+        }
+
+        if (f->fp_off != DW_SAME_FP) {
+            uintptr_t fp_addr = cfa + f->fp_off;
+            if (fp_addr < sp) {
+                break;
+            }
+            fp = *(uintptr_t*)fp_addr;
+        }
+
+        pc = stripPointer(((const void**)cfa)[-1]);
+        sp = cfa;
+    }
+
+    return depth;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _STACKWALKER_H
+#define _STACKWALKER_H
+
+#include "codeCache.h"
+
+
+class StackWalker {
+  public:
+    // Unwinds native frames of the interrupted context using DWARF unwind tables of libraries.
+    // Async signal safe: does not allocate and reads only the current thread's stack.
+    static int walkDwarf(void* ucontext, const void** callchain, int max_depth,
+                         CodeCache* java_methods, CodeCache* runtime_stubs);
+};
+
+#endif // _STACKWALKER_H
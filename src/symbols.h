@@ -27,11 +27,36 @@ class Symbols {
     static Mutex _parse_lock;
     static std::set<const void*> _parsed_libraries;
     static bool _have_kernel_symbols;
+    static bool _lazy;
+    static bool _unwind_tables;
+    static char* _cache_dir;
 
   public:
     static void parseKernelSymbols(NativeCodeCache* cc);
     static void parseLibraries(NativeCodeCache** array, volatile int& count, int size, bool kernel_symbols);
 
+    // Loads symbols of a library registered lazily; does nothing if they are already loaded
+    static void loadSymbols(NativeCodeCache* cc);
+
+    // Builds DWARF unwind tables for the given libraries and for all libraries parsed afterwards
+    static void enableUnwindTables(NativeCodeCache** array, int count);
+
+    // When enabled, libraries found by parseLibraries are registered by address range only
+    static void setLazy(bool lazy) {
+        _lazy = lazy;
+    }
+
+    static bool isLazy() {
+        return _lazy;
+    }
+
+    // Directory for symbol indexes of parsed libraries, keyed by build-id; NULL disables the cache
+    static void setCacheDir(const char* dir);
+
+    static const char* cacheDir() {
+        return _cache_dir;
+    }
+
     static bool haveKernelSymbols() {
         return _have_kernel_symbols;
     }
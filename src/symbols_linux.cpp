@@ -26,30 +26,21 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <linux/limits.h>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include "symbols.h"
 #include "arch.h"
+#include "dwarf.h"
 #include "log.h"
+#include "os.h"
+#include "spinLock.h"
 
 
-class SymbolDesc {
-  private:
-    const char* _addr;
-    const char* _type;
+const size_t KALLSYMS_INITIAL_SIZE = 8 * 1024 * 1024;
 
-  public:
-      SymbolDesc(const char* s) {
-          _addr = s;
-          _type = strchr(_addr, ' ') + 1;
-      }
-
-      const char* addr() { return (const char*)strtoul(_addr, NULL, 16); }
-      char type()        { return _type[0]; }
-      const char* name() { return _type + 2; }
-};
 
 class MemoryMapDesc {
   private:
@@ -77,6 +68,7 @@ class MemoryMapDesc {
       }
 
       const char* file()    { return _file; }
+      bool isReadable()     { return _perm[0] == 'r'; }
       bool isExecutable()   { return _perm[0] == 'r' && _perm[2] == 'x'; }
       const char* addr()    { return (const char*)strtoul(_addr, NULL, 16); }
       const char* end()     { return (const char*)strtoul(_end, NULL, 16); }
@@ -89,6 +81,7 @@ class MemoryMapDesc {
 const unsigned char ELFCLASS_SUPPORTED = ELFCLASS64;
 typedef Elf64_Ehdr ElfHeader;
 typedef Elf64_Shdr ElfSection;
+typedef Elf64_Phdr ElfProgramHeader;
 typedef Elf64_Nhdr ElfNote;
 typedef Elf64_Sym  ElfSymbol;
 typedef Elf64_Rel  ElfRelocation;
@@ -97,6 +90,7 @@ typedef Elf64_Rel  ElfRelocation;
 const unsigned char ELFCLASS_SUPPORTED = ELFCLASS32;
 typedef Elf32_Ehdr ElfHeader;
 typedef Elf32_Shdr ElfSection;
+typedef Elf32_Phdr ElfProgramHeader;
 typedef Elf32_Nhdr ElfNote;
 typedef Elf32_Sym  ElfSymbol;
 typedef Elf32_Rel  ElfRelocation;
@@ -104,6 +98,34 @@ typedef Elf32_Rel  ElfRelocation;
 #endif // __LP64__
 
 
+// Symbol index file layout: header, entries ordered by address, zero-terminated names.
+// Offsets are relative to the library base, so the index can be reused at any load address.
+const char SYMBOL_INDEX_MAGIC[8] = {'A', 'P', 'S', 'Y', 'M', 'I', 'D', 'X'};
+const u32 SYMBOL_INDEX_VERSION = 1;
+
+struct SymbolIndexHeader {
+    char magic[8];
+    u32 version;
+    u32 count;
+    u64 strings_size;
+};
+
+struct SymbolIndexEntry {
+    u64 offset;
+    u32 length;
+    u32 name;
+
+    static int comparator(const void* e1, const void* e2) {
+        const SymbolIndexEntry* entry1 = (const SymbolIndexEntry*)e1;
+        const SymbolIndexEntry* entry2 = (const SymbolIndexEntry*)e2;
+        if (entry1->offset != entry2->offset) {
+            return entry1->offset < entry2->offset ? -1 : 1;
+        }
+        return entry1->length == entry2->length ? 0 : entry1->length > entry2->length ? -1 : 1;
+    }
+};
+
+
 class ElfParser {
   private:
     NativeCodeCache* _cc;
@@ -138,6 +160,10 @@ class ElfParser {
     ElfSection* findSection(uint32_t type, const char* name);
 
     void loadSymbols(bool use_debug);
+    const char* buildId(int* length);
+    bool symbolIndexPath(char* path);
+    bool loadSymbolIndex(const char* path);
+    void saveSymbolIndex(const char* path, int first_blob);
     bool loadSymbolsUsingBuildId();
     bool loadSymbolsUsingDebugLink();
     void loadSymbolTable(ElfSection* symtab);
@@ -146,6 +172,7 @@ class ElfParser {
   public:
     static bool parseFile(NativeCodeCache* cc, const char* base, const char* file_name, bool use_debug);
     static void parseMem(NativeCodeCache* cc, const char* base);
+    static void parseUnwindTable(NativeCodeCache* cc);
 };
 
 
@@ -189,11 +216,45 @@ void ElfParser::parseMem(NativeCodeCache* cc, const char* base) {
     elf.loadSymbols(false);
 }
 
+// Unlike symbols, CFI is always loaded, so it is parsed from memory rather than from the file
+void ElfParser::parseUnwindTable(NativeCodeCache* cc) {
+    const char* base = cc->imageBase();
+    if (base == NULL) {
+        cc->setDwarfTable(NULL, 0);
+        return;
+    }
+
+    ElfParser elf(cc, base, base);
+    if (elf.valid_header()) {
+        const char* pheaders = base + elf._header->e_phoff;
+        for (int i = 0; i < elf._header->e_phnum; i++) {
+            ElfProgramHeader* phdr = (ElfProgramHeader*)(pheaders + i * elf._header->e_phentsize);
+            if (phdr->p_type == PT_GNU_EH_FRAME) {
+                // Addresses in a non-PIE executable are absolute
+                const char* vaddr_base = elf._header->e_type == ET_EXEC ? NULL : base;
+                DwarfParser dwarf(cc->name(), base, vaddr_base + phdr->p_vaddr);
+                cc->setDwarfTable(dwarf.table(), dwarf.count());
+                return;
+            }
+        }
+    }
+
+    cc->setDwarfTable(NULL, 0);
+}
+
 void ElfParser::loadSymbols(bool use_debug) {
     if (!valid_header()) {
         return;
     }
 
+    // Symbols of the main file and its debuginfo may come from the persistent index
+    char index_path[PATH_MAX];
+    bool use_index = use_debug && symbolIndexPath(index_path);
+    if (use_index && loadSymbolIndex(index_path)) {
+        return;
+    }
+    int first_blob = _cc->count();
+
     // Look for debug symbols in the original .so
     ElfSection* section = findSection(SHT_SYMTAB, ".symtab");
     if (section != NULL) {
@@ -226,22 +287,163 @@ loaded:
             addRelocationSymbols(reltab, _base + plt->sh_offset + PLT_HEADER_SIZE);
         }
     }
+
+    if (use_index) {
+        saveSymbolIndex(index_path, first_blob);
+    }
 }
 
-// Load symbols from /usr/lib/debug/.build-id/ab/cdef1234.debug, where abcdef1234 is Build ID
-bool ElfParser::loadSymbolsUsingBuildId() {
+const char* ElfParser::buildId(int* length) {
     ElfSection* section = findSection(SHT_NOTE, ".note.gnu.build-id");
     if (section == NULL || section->sh_size <= 16) {
-        return false;
+        return NULL;
     }
 
     ElfNote* note = (ElfNote*)at(section);
     if (note->n_namesz != 4 || note->n_descsz < 2 || note->n_descsz > 64) {
+        return NULL;
+    }
+
+    *length = note->n_descsz;
+    return (const char*)note + sizeof(*note) + 4;
+}
+
+// Index file is named after the Build ID: <cache_dir>/abcdef1234.sym
+bool ElfParser::symbolIndexPath(char* path) {
+    const char* cache_dir = Symbols::cacheDir();
+    if (cache_dir == NULL || strlen(cache_dir) > PATH_MAX - 160) {
         return false;
     }
 
-    const char* build_id = (const char*)note + sizeof(*note) + 4;
-    int build_id_len = note->n_descsz;
+    int build_id_len;
+    const char* build_id = buildId(&build_id_len);
+    if (build_id == NULL) {
+        return false;
+    }
+
+    char* p = path + sprintf(path, "%s/", cache_dir);
+    for (int i = 0; i < build_id_len; i++) {
+        p += sprintf(p, "%02hhx", build_id[i]);
+    }
+    strcpy(p, ".sym");
+    return true;
+}
+
+bool ElfParser::loadSymbolIndex(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    // Other processes may rewrite the file at any time, so validate and keep a private copy.
+    // The image is freed with munmap together with the cache.
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    char* addr = size >= sizeof(SymbolIndexHeader) ? (char*)OS::safeAlloc(size) : NULL;
+    if (addr == NULL) {
+        close(fd);
+        return false;
+    }
+
+    size_t loaded = 0;
+    for (ssize_t bytes; loaded < size && (bytes = read(fd, addr + loaded, size - loaded)) > 0; ) {
+        loaded += bytes;
+    }
+    close(fd);
+    if (loaded < size) {
+        OS::safeFree(addr, size);
+        return false;
+    }
+
+    const SymbolIndexHeader* header = (const SymbolIndexHeader*)addr;
+    const SymbolIndexEntry* entries = (const SymbolIndexEntry*)(header + 1);
+    const char* strings = (const char*)(entries + header->count);
+
+    // The index is only trusted after full validation: it is shared between processes
+    bool valid = memcmp(header->magic, SYMBOL_INDEX_MAGIC, sizeof(SYMBOL_INDEX_MAGIC)) == 0
+        && header->version == SYMBOL_INDEX_VERSION
+        && header->strings_size > 0 && header->strings_size < size
+        && sizeof(SymbolIndexHeader) + (u64)header->count * sizeof(SymbolIndexEntry) + header->strings_size == size
+        && strings[header->strings_size - 1] == 0;
+    for (u32 i = 0; valid && i < header->count; i++) {
+        valid = entries[i].name < header->strings_size;
+    }
+
+    if (!valid || !_cc->attachSymbolImage(addr, size)) {
+        Log::warn("Ignoring symbol index %s", path);
+        OS::safeFree(addr, size);
+        return false;
+    }
+
+    for (u32 i = 0; i < header->count; i++) {
+        _cc->addMapped(_base + entries[i].offset, entries[i].length, strings + entries[i].name);
+    }
+    return true;
+}
+
+void ElfParser::saveSymbolIndex(const char* path, int first_blob) {
+    const CodeBlob* blobs = _cc->blobs() + first_blob;
+    int count = _cc->count() - first_blob;
+    if (count <= 0) {
+        return;
+    }
+
+    size_t strings_size = 0;
+    for (int i = 0; i < count; i++) {
+        strings_size += strlen((const char*)blobs[i]._method) + 1;
+    }
+
+    size_t size = sizeof(SymbolIndexHeader) + count * sizeof(SymbolIndexEntry) + strings_size;
+    char* buf = (char*)malloc(size);
+    if (buf == NULL) {
+        return;
+    }
+
+    SymbolIndexHeader* header = (SymbolIndexHeader*)buf;
+    memcpy(header->magic, SYMBOL_INDEX_MAGIC, sizeof(SYMBOL_INDEX_MAGIC));
+    header->version = SYMBOL_INDEX_VERSION;
+    header->count = count;
+    header->strings_size = strings_size;
+
+    SymbolIndexEntry* entries = (SymbolIndexEntry*)(header + 1);
+    char* strings = (char*)(entries + count);
+    u32 name = 0;
+    for (int i = 0; i < count; i++) {
+        const char* blob_name = (const char*)blobs[i]._method;
+        size_t name_size = strlen(blob_name) + 1;
+        memcpy(strings + name, blob_name, name_size);
+
+        entries[i].offset = (const char*)blobs[i]._start - _base;
+        entries[i].length = (u32)((const char*)blobs[i]._end - (const char*)blobs[i]._start);
+        entries[i].name = name;
+        name += name_size;
+    }
+    qsort(entries, count, sizeof(SymbolIndexEntry), SymbolIndexEntry::comparator);
+
+    // Write to a temporary file and rename it, so that concurrent readers never see a partial index
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%d", path, OS::processId(), OS::threadId());
+    mkdir(Symbols::cacheDir(), 0755);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+        ssize_t written = write(fd, buf, size);
+        close(fd);
+        if (written != (ssize_t)size || rename(tmp_path, path) != 0) {
+            unlink(tmp_path);
+        }
+    }
+
+    free(buf);
+}
+
+// Load symbols from /usr/lib/debug/.build-id/ab/cdef1234.debug, where abcdef1234 is Build ID
+bool ElfParser::loadSymbolsUsingBuildId() {
+    int build_id_len;
+    const char* build_id = buildId(&build_id_len);
+    if (build_id == NULL) {
+        return false;
+    }
 
     char path[PATH_MAX];
     char* p = path + sprintf(path, "/usr/lib/debug/.build-id/%02hhx/", build_id[0]);
@@ -342,25 +544,208 @@ void ElfParser::addRelocationSymbols(ElfSection* reltab, const char* plt) {
 Mutex Symbols::_parse_lock;
 std::set<const void*> Symbols::_parsed_libraries;
 bool Symbols::_have_kernel_symbols = false;
+bool Symbols::_lazy = false;
+bool Symbols::_unwind_tables = false;
+char* Symbols::_cache_dir = NULL;
+
+void Symbols::setCacheDir(const char* dir) {
+    MutexLocker ml(_parse_lock);
+    free(_cache_dir);
+    _cache_dir = dir != NULL ? strdup(dir) : NULL;
+}
+
+static inline int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Reads the whole file into an anonymous mapping followed by at least one spare byte.
+// Sizes of /proc files are not known in advance, so the mapping grows as needed.
+static char* readWholeFile(const char* file_name, size_t* size, size_t* capacity) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    *size = 0;
+    *capacity = KALLSYMS_INITIAL_SIZE;
+    char* buf = (char*)OS::safeAlloc(*capacity);
+
+    ssize_t bytes;
+    while (buf != NULL && (bytes = read(fd, buf + *size, *capacity - *size - 1)) > 0) {
+        *size += bytes;
+        if (*capacity - *size <= 1) {
+            void* new_buf = mremap(buf, *capacity, *capacity * 2, MREMAP_MAYMOVE);
+            if (new_buf == MAP_FAILED) {
+                OS::safeFree(buf, *capacity);
+                buf = NULL;
+            } else {
+                buf = (char*)new_buf;
+                *capacity *= 2;
+            }
+        }
+    }
+
+    close(fd);
+    if (buf != NULL) {
+        buf[*size] = 0;
+    }
+    return buf;
+}
 
 void Symbols::parseKernelSymbols(NativeCodeCache* cc) {
-    std::ifstream maps("/proc/kallsyms");
-    std::string str;
+    size_t size, capacity;
+    char* buf = readWholeFile("/proc/kallsyms", &size, &capacity);
+    if (buf == NULL) {
+        return;
+    }
+
+    // Lines look like "ffffffff81000000 T name\t[module]". The address with type is longer
+    // than the appended "_[k]" suffix, so names are packed in place at the start of the buffer.
+    const char* end = buf + size;
+    char* names = buf;
 
-    while (std::getline(maps, str)) {
-        str += "_[k]";
-        SymbolDesc symbol(str.c_str());
-        char type = symbol.type();
-        if (type == 'T' || type == 't' || type == 'W' || type == 'w') {
-            const char* addr = symbol.addr();
-            if (addr != NULL) {
-                cc->add(addr, 0, symbol.name());
-                _have_kernel_symbols = true;
+    for (const char* p = buf; p < end; ) {
+        const char* line_end = (const char*)memchr(p, '\n', end - p);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+
+        uintptr_t addr = 0;
+        for (int digit; (digit = hexDigit(*p)) >= 0; p++) {
+            addr = addr << 4 | digit;
+        }
+
+        if (addr != 0 && p + 3 <= line_end && p[0] == ' ' && p[2] == ' ') {
+            char type = p[1];
+            if (type == 'T' || type == 't' || type == 'W' || type == 'w') {
+                char* name = names;
+                for (p += 3; p < line_end; p++) {
+                    *names++ = *p < ' ' ? '?' : *p;
+                }
+                memcpy(names, "_[k]", 5);
+                names += 5;
+                cc->addMapped((const void*)addr, 0, name);
             }
         }
+
+        p = line_end + 1;
+    }
+
+    if (names == buf) {
+        // No symbols or all addresses are hidden by kptr_restrict
+        OS::safeFree(buf, capacity);
+        return;
     }
+
+    // Return unused pages of the buffer and keep the rest as the name arena
+    size_t used = (names - buf + OS::page_mask) & ~OS::page_mask;
+    if (used < capacity) {
+        OS::safeFree(buf + used, capacity - used);
+    }
+    cc->attachSymbolImage(buf, used);
+    _have_kernel_symbols = true;
 }
 
+// Parses a batch of libraries in a small pool of threads. A library is published to the array
+// only when its symbols are loaded, so that readers never see a partial one, and only after
+// all libraries before it, so that the array keeps the order of /proc/self/maps.
+class LibraryParser {
+  private:
+    static const int MAX_THREADS = 8;
+
+    NativeCodeCache** _array;
+    volatile int& _count;
+    NativeCodeCache** _pending;
+    const char** _bases;
+    bool* _parsed;
+    int _pending_count;
+    int _parse_count;
+    int _published;
+    volatile int _next;
+    SpinLock _publish_lock;
+
+    static void* threadEntry(void* parser) {
+        ((LibraryParser*)parser)->parseAll();
+        return NULL;
+    }
+
+    void parseAll() {
+        int i;
+        while ((i = atomicInc(_next)) < _pending_count) {
+            NativeCodeCache* cc = _pending[i];
+            if (_bases[i] != NULL) {
+                ElfParser::parseFile(cc, _bases[i], cc->name(), true);
+            }
+            cc->sort();
+            publish(i);
+        }
+    }
+
+    // Marks the library parsed and publishes all parsed libraries up to the first gap
+    void publish(int index) {
+        _publish_lock.lock();
+        _parsed[index] = true;
+        while (_published < _pending_count && _parsed[_published]) {
+            _array[_count] = _pending[_published++];
+            atomicInc(_count);
+        }
+        _publish_lock.unlock();
+    }
+
+  public:
+    LibraryParser(NativeCodeCache** array, volatile int& count, int capacity) :
+        _array(array), _count(count), _pending_count(0), _parse_count(0), _published(0), _next(0), _publish_lock() {
+        _pending = new NativeCodeCache*[capacity];
+        _bases = new const char*[capacity];
+        _parsed = new bool[capacity];
+    }
+
+    ~LibraryParser() {
+        delete[] _parsed;
+        delete[] _bases;
+        delete[] _pending;
+    }
+
+    int pendingCount() {
+        return _pending_count;
+    }
+
+    // base == NULL means the library needs no reading from file
+    void enqueue(NativeCodeCache* cc, const char* base) {
+        _pending[_pending_count] = cc;
+        _bases[_pending_count] = base;
+        _parsed[_pending_count] = false;
+        _pending_count++;
+        if (base != NULL) {
+            _parse_count++;
+        }
+    }
+
+    void run() {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int threads = cpus < MAX_THREADS ? (int)cpus : MAX_THREADS;
+        if (threads > _parse_count) {
+            threads = _parse_count;
+        }
+
+        // The calling thread is one of the workers
+        pthread_t helpers[MAX_THREADS];
+        int started = 0;
+        while (started < threads - 1 && pthread_create(&helpers[started], NULL, threadEntry, this) == 0) {
+            started++;
+        }
+
+        parseAll();
+
+        for (int i = 0; i < started; i++) {
+            pthread_join(helpers[i], NULL);
+        }
+    }
+};
+
 void Symbols::parseLibraries(NativeCodeCache** array, volatile int& count, int size, bool kernel_symbols) {
     MutexLocker ml(_parse_lock);
 
@@ -379,9 +764,29 @@ void Symbols::parseLibraries(NativeCodeCache** array, volatile int& count, int s
 
     std::ifstream maps("/proc/self/maps");
     std::string str;
+    LibraryParser parser(array, count, size);
+
+    // The first mapping of a file contains its ELF header
+    const char* header_addr = NULL;
+    unsigned long header_inode = 0;
 
-    while (count < size && std::getline(maps, str)) {
+    // Data segments of a library follow its code
+    NativeCodeCache* last_cc = NULL;
+    unsigned long last_inode = 0;
+
+    while (count + parser.pendingCount() < size && std::getline(maps, str)) {
         MemoryMapDesc map(str.c_str());
+        if (map.offs() == 0 && map.isReadable()) {
+            header_addr = map.addr();
+            header_inode = map.inode();
+        }
+
+        if (last_cc != NULL && map.inode() == last_inode && !map.isExecutable()) {
+            last_cc->setImageEnd(map.end());
+        } else {
+            last_cc = NULL;
+        }
+
         if (map.isExecutable() && map.file() != NULL && map.file()[0] != 0) {
             const char* image_base = map.addr();
             if (!_parsed_libraries.insert(image_base).second) {
@@ -389,18 +794,59 @@ void Symbols::parseLibraries(NativeCodeCache** array, volatile int& count, int s
             }
 
             NativeCodeCache* cc = new NativeCodeCache(map.file(), image_base, map.end());
+            if (map.inode() != 0) {
+                last_cc = cc;
+                last_inode = map.inode();
+            }
+
+            if (header_addr == image_base - map.offs() && header_inode == map.inode()) {
+                cc->setImageBase(header_addr);
+                if (_unwind_tables) {
+                    ElfParser::parseUnwindTable(cc);
+                }
+            }
 
             if (map.inode() != 0) {
-                ElfParser::parseFile(cc, image_base - map.offs(), map.file(), true);
+                if (!_lazy) {
+                    // Reading a file may be slow, so postpone it to parse multiple libraries at once
+                    parser.enqueue(cc, image_base - map.offs());
+                    continue;
+                }
+                cc->setLazy(map.file(), image_base - map.offs());
             } else if (strcmp(map.file(), "[vdso]") == 0) {
                 ElfParser::parseMem(cc, image_base);
             }
 
-            cc->sort();
-            array[count] = cc;
-            atomicInc(count);
+            parser.enqueue(cc, NULL);
         }
     }
+
+    if (parser.pendingCount() > 0) {
+        parser.run();
+    }
+}
+
+void Symbols::enableUnwindTables(NativeCodeCache** array, int count) {
+    MutexLocker ml(_parse_lock);
+
+    _unwind_tables = true;
+    for (int i = 0; i < count; i++) {
+        if (!array[i]->dwarfParsed()) {
+            ElfParser::parseUnwindTable(array[i]);
+        }
+    }
+}
+
+void Symbols::loadSymbols(NativeCodeCache* cc) {
+    MutexLocker ml(_parse_lock);
+
+    if (!cc->symbolsLoaded()) {
+        // Parse aside, since the library may be concurrently looked up by a signal handler
+        NativeCodeCache parsed(cc->name(), cc->minAddress(), cc->maxAddress());
+        ElfParser::parseFile(&parsed, cc->lazyBase(), cc->lazyFile(), true);
+        parsed.sort();
+        cc->adoptSymbols(&parsed);
+    }
 }
 
 #endif // __linux__
@@ -97,6 +97,9 @@ class MachOParser {
 Mutex Symbols::_parse_lock;
 std::set<const void*> Symbols::_parsed_libraries;
 bool Symbols::_have_kernel_symbols = false;
+bool Symbols::_lazy = false;
+bool Symbols::_unwind_tables = false;
+char* Symbols::_cache_dir = NULL;
 
 void Symbols::parseKernelSymbols(NativeCodeCache* cc) {
 }
@@ -132,4 +135,16 @@ void Symbols::parseLibraries(NativeCodeCache** array, volatile int& count, int s
     }
 }
 
+void Symbols::loadSymbols(NativeCodeCache* cc) {
+    // Mach-O images are always parsed eagerly
+}
+
+void Symbols::enableUnwindTables(NativeCodeCache** array, int count) {
+    // DWARF unwinding is supported only for ELF libraries
+}
+
+void Symbols::setCacheDir(const char* dir) {
+    // Symbol index cache is supported only for ELF libraries
+}
+
 #endif // __APPLE__
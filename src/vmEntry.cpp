@@ -22,6 +22,7 @@
 #include "javaApi.h"
 #include "os.h"
 #include "profiler.h"
+#include "symbols.h"
 #include "instrument.h"
 #include "lockTracer.h"
 #include "log.h"
@@ -274,6 +275,14 @@ Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
         return ARGUMENTS_ERROR;
     }
 
+    // Must be known before the initial parsing of native libraries
+    if (_agent_args._lazy_symbols) {
+        Symbols::setLazy(true);
+    }
+    if (_agent_args._symcache != NULL) {
+        Symbols::setCacheDir(_agent_args._symcache);
+    }
+
     if (!VM::init(vm, false)) {
         Log::error("JVM does not support Tool Interface");
         return COMMAND_ERROR;
@@ -292,6 +301,13 @@ Agent_OnAttach(JavaVM* vm, char* options, void* reserved) {
         return ARGUMENTS_ERROR;
     }
 
+    if (args._lazy_symbols) {
+        Symbols::setLazy(true);
+    }
+    if (args._symcache != NULL) {
+        Symbols::setCacheDir(args._symcache);
+    }
+
     if (!VM::init(vm, true)) {
         Log::error("JVM does not support Tool Interface");
         return COMMAND_ERROR;
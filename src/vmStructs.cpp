@@ -43,7 +43,12 @@ int VMStructs::_anchor_sp_offset = -1;
 int VMStructs::_anchor_pc_offset = -1;
 int VMStructs::_frame_size_offset = -1;
 int VMStructs::_is_gc_active_offset = -1;
+int VMStructs::_heap_reserved_offset = -1;
+int VMStructs::_region_start_offset = -1;
+int VMStructs::_region_word_size_offset = -1;
 char* VMStructs::_collected_heap_addr = NULL;
+const char* VMStructs::_heap_start = NULL;
+const char* VMStructs::_heap_end = NULL;
 
 jfieldID VMStructs::_eetop;
 jfieldID VMStructs::_tid;
@@ -72,6 +77,7 @@ void VMStructs::init(NativeCodeCache* libjvm) {
     _libjvm = libjvm;
 
     initOffsets();
+    initHeapBounds();
     initJvmFunctions();
 
     JNIEnv* env = VM::jni();
@@ -151,6 +157,14 @@ void VMStructs::initOffsets() {
         } else if (strcmp(type, "CollectedHeap") == 0) {
             if (strcmp(field, "_is_gc_active") == 0) {
                 _is_gc_active_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_reserved") == 0) {
+                _heap_reserved_offset = *(int*)(entry + offset_offset);
+            }
+        } else if (strcmp(type, "MemRegion") == 0) {
+            if (strcmp(field, "_start") == 0) {
+                _region_start_offset = *(int*)(entry + offset_offset);
+            } else if (strcmp(field, "_word_size") == 0) {
+                _region_word_size_offset = *(int*)(entry + offset_offset);
             }
         } else if (strcmp(type, "PermGen") == 0) {
             _has_perm_gen = true;
@@ -165,6 +179,22 @@ void VMStructs::initOffsets() {
             && _klass != NULL;
 }
 
+// The reserved region of the heap does not change after the JVM is initialized
+void VMStructs::initHeapBounds() {
+    if (_collected_heap_addr == NULL || _heap_reserved_offset < 0
+        || _region_start_offset < 0 || _region_word_size_offset < 0) {
+        return;
+    }
+
+    const char* region = _collected_heap_addr + _heap_reserved_offset;
+    const char* start = *(const char**)(region + _region_start_offset);
+    size_t word_size = *(size_t*)(region + _region_word_size_offset);
+    if (start != NULL && word_size > 0) {
+        _heap_start = start;
+        _heap_end = start + word_size * sizeof(void*);
+    }
+}
+
 void VMStructs::initJvmFunctions() {
     _get_stack_trace = (GetStackTraceFunc)_libjvm->findSymbol("_ZN8JvmtiEnv13GetStackTraceEP10JavaThreadiiP15_jvmtiFrameInfoPi");
     if (_get_stack_trace == NULL) {
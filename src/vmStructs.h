@@ -45,7 +45,12 @@ class VMStructs {
     static int _anchor_pc_offset;
     static int _frame_size_offset;
     static int _is_gc_active_offset;
+    static int _heap_reserved_offset;
+    static int _region_start_offset;
+    static int _region_word_size_offset;
     static char* _collected_heap_addr;
+    static const char* _heap_start;
+    static const char* _heap_end;
 
     static jfieldID _eetop;
     static jfieldID _tid;
@@ -65,6 +70,7 @@ class VMStructs {
 
     static uintptr_t readSymbol(const char* symbol_name);
     static void initOffsets();
+    static void initHeapBounds();
     static void initJvmFunctions();
     static void initThreadBridge(JNIEnv* env);
     static void initLogging(JNIEnv* env);
@@ -248,6 +254,11 @@ class CollectedHeap : VMStructs {
         return _collected_heap_addr != NULL && _is_gc_active_offset >= 0 &&
                _collected_heap_addr[_is_gc_active_offset] != 0;
     }
+
+    // Reserved address range of the Java heap, if known
+    static bool contains(const void* address) {
+        return address >= _heap_start && address < _heap_end;
+    }
 };
 
 class DisableSweeper : VMStructs {
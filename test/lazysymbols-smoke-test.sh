@@ -0,0 +1,47 @@
+#!/bin/bash
+
+set -e  # exit on any failure
+set -x  # print all executed lines
+
+if [ -z "${JAVA_HOME}" ]; then
+  echo "JAVA_HOME is not set"
+  exit 1
+fi
+
+(
+  cd $(dirname $0)
+
+  if [ "Target.class" -ot "Target.java" ]; then
+     ${JAVA_HOME}/bin/javac Target.java
+  fi
+
+  FILENAME=/tmp/java.trace
+  SYMCACHE=/tmp/async-profiler-symcache
+  rm -rf $SYMCACHE
+
+  function assert_string() {
+    if ! grep -q "$1" $FILENAME; then
+      exit 1
+    fi
+  }
+
+  # The first JVM builds the symbol cache, the second one reads it
+  for run in 1 2; do
+    ${JAVA_HOME}/bin/java Target &
+    JAVAPID=$!
+
+    sleep 1     # allow the Java runtime to initialize
+    ../profiler.sh -f $FILENAME -o collapsed -d 5 --lazysymbols --symcache $SYMCACHE $JAVAPID
+
+    kill $JAVAPID
+
+    assert_string "Target.main;Target.method1 "
+    assert_string "Target.main;Target.method3;java/io/File"
+    # Symbols of a lazy library are loaded once a sample hits it
+    assert_string "Java_java_io_UnixFileSystem_list"
+
+    ls $SYMCACHE/*.sym > /dev/null
+  done
+
+  rm -rf $SYMCACHE
+)
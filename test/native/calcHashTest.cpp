@@ -0,0 +1,219 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares CallTraceStorage::calcHash with the original single-chain MurmurHash64A:
+// 64-bit collisions, distribution over hash table slots, probe lengths, and speed.
+// Usage: calcHashTest [traces]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "callTraceStorage.h"
+#include "testUtil.h"
+
+
+static const int MAX_DEPTH = 1024;
+static const u32 CAPACITY = 65536;  // initial LongHashTable capacity
+
+// The hash used before the multi-lane version
+static u64 murmurHash(int num_frames, ASGCT_CallFrame* frames) {
+    const u64 M = 0xc6a4a7935bd1e995ULL;
+    const int R = 47;
+
+    int len = num_frames * sizeof(ASGCT_CallFrame);
+    u64 h = len * M;
+
+    const u64* data = (const u64*)frames;
+    const u64* end = data + len / 8;
+
+    while (data != end) {
+        u64 k = *data++;
+        k *= M;
+        k ^= k >> R;
+        k *= M;
+        h ^= k;
+        h *= M;
+    }
+
+    if (len & 4) {
+        h ^= *(u32*)data;
+        h *= M;
+    }
+
+    h ^= h >> R;
+    h *= M;
+    h ^= h >> R;
+
+    return h;
+}
+
+typedef u64 (*HashFunction)(int num_frames, ASGCT_CallFrame* frames);
+
+// Realistic frames: jmethodIDs are 8-byte aligned pointers from a few malloc'ed blocks,
+// bci values are small, stacks share common roots
+static int makeTrace(u32 index, ASGCT_CallFrame* frames) {
+    Rng rng(index);
+    int depth = 5 + rng.next(120);
+    for (int i = 0; i < depth; i++) {
+        u32 method = i >= depth - 20 ? i : rng.next(30000);
+        frames[i].bci = rng.next(4) == 0 ? BCI_NATIVE_FRAME : rng.next(200);
+        frames[i].method_id = (jmethodID)(0x7f3a5c000000ULL + (method / 1000) * 0x100000 + (method % 1000) * 8);
+    }
+    return depth;
+}
+
+static bool lessTrace(const std::vector<ASGCT_CallFrame>& a, const std::vector<ASGCT_CallFrame>& b) {
+    if (a.size() != b.size()) {
+        return a.size() < b.size();
+    }
+    return memcmp(&a[0], &b[0], a.size() * sizeof(ASGCT_CallFrame)) < 0;
+}
+
+static bool equalTrace(const std::vector<ASGCT_CallFrame>& a, const std::vector<ASGCT_CallFrame>& b) {
+    return a.size() == b.size() && memcmp(&a[0], &b[0], a.size() * sizeof(ASGCT_CallFrame)) == 0;
+}
+
+// Base traces plus near duplicates: one bci changed by 1, two adjacent frames swapped, top frame dropped
+static void buildCorpus(u32 count, std::vector<std::vector<ASGCT_CallFrame> >& corpus) {
+    ASGCT_CallFrame frames[MAX_DEPTH];
+    for (u32 i = 0; corpus.size() < count; i++) {
+        int depth = makeTrace(i, frames);
+        corpus.push_back(std::vector<ASGCT_CallFrame>(frames, frames + depth));
+
+        int k = i % depth;
+        frames[k].bci++;
+        corpus.push_back(std::vector<ASGCT_CallFrame>(frames, frames + depth));
+        frames[k].bci--;
+
+        if (k + 1 < depth && frames[k].method_id != frames[k + 1].method_id) {
+            std::swap(frames[k], frames[k + 1]);
+            corpus.push_back(std::vector<ASGCT_CallFrame>(frames, frames + depth));
+            std::swap(frames[k], frames[k + 1]);
+        }
+
+        corpus.push_back(std::vector<ASGCT_CallFrame>(frames + 1, frames + depth));
+    }
+
+    // Only distinct inputs count; shuffle them back, since sorting would skew the slot distribution
+    std::sort(corpus.begin(), corpus.end(), lessTrace);
+    corpus.erase(std::unique(corpus.begin(), corpus.end(), equalTrace), corpus.end());
+    Rng rng(count);
+    for (size_t i = corpus.size() - 1; i > 0; i--) {
+        std::swap(corpus[i], corpus[rng.next(i + 1)]);
+    }
+}
+
+struct Quality {
+    u64 collisions;
+    double chi2;
+    u32 max_load;
+    double avg_probes;
+};
+
+static Quality measure(HashFunction hash, std::vector<std::vector<ASGCT_CallFrame> >& corpus) {
+    Quality q;
+
+    std::vector<u64> hashes;
+    for (size_t i = 0; i < corpus.size(); i++) {
+        hashes.push_back(hash(corpus[i].size(), &corpus[i][0]));
+    }
+
+    // Distinct inputs with equal 64-bit hashes would be merged into one trace
+    std::vector<u64> sorted(hashes);
+    std::sort(sorted.begin(), sorted.end());
+    q.collisions = sorted.end() - std::unique(sorted.begin(), sorted.end());
+
+    // Slot distribution of the first 3/4 * CAPACITY keys, i.e. until the table is expanded
+    u32 keys = CAPACITY / 4 * 3;
+    std::vector<u32> load(CAPACITY);
+    for (u32 i = 0; i < keys; i++) {
+        load[hashes[i] & (CAPACITY - 1)]++;
+    }
+    double expected = (double)keys / CAPACITY;
+    q.chi2 = 0;
+    q.max_load = 0;
+    for (u32 i = 0; i < CAPACITY; i++) {
+        q.chi2 += (load[i] - expected) * (load[i] - expected) / expected;
+        q.max_load = std::max(q.max_load, load[i]);
+    }
+
+    // Probe sequence of CallTraceStorage::put
+    std::vector<u64> table(CAPACITY);
+    u64 probes = 0;
+    for (u32 i = 0; i < keys; i++) {
+        u32 slot = hashes[i] & (CAPACITY - 1);
+        for (u32 step = 0; table[slot] != 0 && table[slot] != hashes[i]; ) {
+            slot = (slot + ++step) & (CAPACITY - 1);
+            probes++;
+        }
+        table[slot] = hashes[i];
+        probes++;
+    }
+    q.avg_probes = (double)probes / keys;
+
+    return q;
+}
+
+static double timeHash(HashFunction hash, int depth) {
+    ASGCT_CallFrame frames[MAX_DEPTH];
+    for (int i = 0; i < depth; i++) {
+        frames[i].bci = i;
+        frames[i].method_id = (jmethodID)(0x7f3a5c000000ULL + i * 8);
+    }
+
+    int iterations = 20000000 / depth;
+    volatile u64 sink = 0;
+    u64 start = nanotime();
+    for (int i = 0; i < iterations; i++) {
+        frames[0].bci = i;
+        sink += hash(depth, frames);
+    }
+    return (double)(nanotime() - start) / iterations;
+}
+
+int main(int argc, char** argv) {
+    u32 count = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    std::vector<std::vector<ASGCT_CallFrame> > corpus;
+    buildCorpus(count, corpus);
+
+    Quality murmur = measure(murmurHash, corpus);
+    Quality current = measure(CallTraceStorage::calcHash, corpus);
+
+    // For a uniform hash, chi2 is about CAPACITY with a standard deviation of sqrt(2 * CAPACITY)
+    printf("%u distinct traces, %u slots\n", (u32)corpus.size(), CAPACITY);
+    printf("%-10s  collisions=%llu  chi2=%.0f  max load=%u  avg probes=%.3f\n", "murmur",
+           (unsigned long long)murmur.collisions, murmur.chi2, murmur.max_load, murmur.avg_probes);
+    printf("%-10s  collisions=%llu  chi2=%.0f  max load=%u  avg probes=%.3f\n", "calcHash",
+           (unsigned long long)current.collisions, current.chi2, current.max_load, current.avg_probes);
+
+    int depths[] = {10, 100, 1000};
+    for (int i = 0; i < 3; i++) {
+        printf("depth %4d: murmur %7.1f ns, calcHash %7.1f ns\n", depths[i],
+               timeHash(murmurHash, depths[i]), timeHash(CallTraceStorage::calcHash, depths[i]));
+    }
+
+    double chi2_limit = CAPACITY + 6 * sqrt(2.0 * CAPACITY);
+    if (current.collisions > murmur.collisions || current.chi2 > chi2_limit
+        || current.avg_probes > murmur.avg_probes * 1.05) {
+        printf("FAILED: calcHash distribution is worse than expected\n");
+        return 1;
+    }
+    return 0;
+}
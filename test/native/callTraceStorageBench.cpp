@@ -0,0 +1,122 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Concurrent CallTraceStorage::put() throughput with shared atomic counters vs. private shards.
+// Usage: callTraceStorageBench [threads] [puts per thread]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "callTraceStorage.h"
+#include "profiler.h"
+#include "testUtil.h"
+
+
+static const int TRACE_COUNT = 1024;
+static const int TRACE_DEPTH = 32;
+static const u32 OVERFLOW_TRACE_ID = 0x7fffffff;  // same as in callTraceStorage.cpp
+
+static ASGCT_CallFrame traces[TRACE_COUNT][TRACE_DEPTH];
+static CallTraceStorage* storage;
+static long puts_per_thread;
+static volatile long overflows;
+
+
+// Stacks share a common root, like real Java stacks do
+static void generateTraces() {
+    srand(1);
+    for (int i = 0; i < TRACE_COUNT; i++) {
+        for (int j = 0; j < TRACE_DEPTH; j++) {
+            int method = j >= TRACE_DEPTH - 8 ? j : rand() % 4096;
+            traces[i][j].bci = rand() % 64;
+            traces[i][j].method_id = (jmethodID)(0x7f0000100000 + method * 0x40);
+        }
+    }
+}
+
+static void* putThread(void* arg) {
+    u32 shard = (u32)(size_t)arg;
+    ASGCT_CallFrame frames[TRACE_DEPTH];
+    u32 seed = shard + 1;
+    long overflow = 0;
+
+    for (long i = 0; i < puts_per_thread; i++) {
+        // Skewed distribution: half of the samples hit 16 hot traces
+        seed = seed * 1103515245 + 12345;
+        int trace = (seed >> 16) & 1 ? (seed >> 17) % 16 : (seed >> 17) % TRACE_COUNT;
+        for (int j = 0; j < TRACE_DEPTH; j++) {
+            frames[j] = traces[trace][j];
+        }
+        // A slot may stay unpublished for too long if its owner is preempted; such samples are overflow
+        if (storage->put(TRACE_DEPTH, frames, 1000, shard) == OVERFLOW_TRACE_ID) {
+            overflow++;
+        }
+    }
+    __sync_fetch_and_add(&overflows, overflow);
+    return NULL;
+}
+
+static bool run(const char* name, int threads, u32 shards) {
+    storage = new CallTraceStorage();
+    storage->setShards(shards);
+    storage->clear();
+    overflows = 0;
+
+    std::vector<pthread_t> tids(threads);
+    u64 start = nanotime();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, putThread, (void*)(size_t)(i % CONCURRENCY_LEVEL));
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    u64 elapsed = nanotime() - start;
+
+    std::vector<CallTraceSample*> samples;
+    storage->collectSamples(samples);
+    u64 total = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        total += samples[i]->samples;
+    }
+    delete storage;
+
+    u64 expected = (u64)threads * puts_per_thread;
+    printf("%-8s threads=%-2d  %8.1f ns/put  %10.0f puts/s  traces=%d  overflow=%ld\n", name, threads,
+           (double)elapsed * threads / expected, expected * 1e9 / elapsed, (int)samples.size(), overflows);
+    if (total + overflows != expected) {
+        printf("FAILED: %s counted %lld samples, expected %lld\n", name, (long long)total, (long long)expected);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : CONCURRENCY_LEVEL;
+    puts_per_thread = argc > 2 ? atol(argv[2]) : 1000000;
+    if (max_threads > CONCURRENCY_LEVEL) {
+        max_threads = CONCURRENCY_LEVEL;  // one shard per thread, as with profiler locks
+    }
+
+    generateTraces();
+
+    bool ok = true;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        ok &= run("shared", threads, 0);
+        ok &= run("sharded", threads, CONCURRENCY_LEVEL);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// CodeCache lookups after interleaved add/remove, and the worst-case latency of add() and find().
+// A reader thread looks up blobs without locking while they are added and removed,
+// like a signal handler does; replaced arrays are freed after the same lock cycle as in Profiler.
+// Usage: codeCacheTest [blobs]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include "codeCache.h"
+#include "spinLock.h"
+#include "testUtil.h"
+
+
+static const size_t BLOB_SIZE = 256;
+static const char* const BASE = (const char*)0x7f0010000000;
+
+static jmethodID methodOf(int slot) {
+    return (jmethodID)(size_t)(slot + 1);
+}
+
+static CodeCache* cache;
+static SpinLock reader_lock;
+static volatile bool running = true;
+static volatile int max_slot = 0;
+static u64 max_find = 0;
+static u64 total_find = 0;
+static long finds = 0;
+static long wrong_finds = 0;
+
+static void* readerLoop(void* arg) {
+    unsigned int seed = 2;
+    while (running) {
+        int slot = rand_r(&seed) % (max_slot + 1);
+        const void* address = BASE + slot * BLOB_SIZE + BLOB_SIZE / 2;
+
+        reader_lock.lock();
+        u64 start = nanotime();
+        jmethodID method = cache->find(address);
+        u64 elapsed = nanotime() - start;
+        reader_lock.unlock();
+
+        max_find = std::max(max_find, elapsed);
+        total_find += elapsed;
+        finds++;
+        if (method != NULL && method != methodOf(slot)) {
+            wrong_finds++;
+        }
+    }
+    return NULL;
+}
+
+static void freeRetired() {
+    CodeBlobArray* retired = cache->detachRetired();
+    reader_lock.lock();
+    reader_lock.unlock();
+    CodeCache::freeArrays(retired);
+}
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 200000;
+
+    // JIT code is placed anywhere in the code cache, not in address order
+    std::vector<int> slots(count);
+    for (int i = 0; i < count; i++) {
+        slots[i] = i;
+    }
+    srand(1);
+    for (int i = count - 1; i > 0; i--) {
+        std::swap(slots[i], slots[rand() % (i + 1)]);
+    }
+
+    cache = new CodeCache();
+    pthread_t reader;
+    pthread_create(&reader, NULL, readerLoop, NULL);
+
+    std::vector<bool> live(count);
+    u64 max_add = 0;
+    u64 total_add = 0;
+
+    for (int i = 0; i < count; i++) {
+        int slot = slots[i];
+        u64 start = nanotime();
+        cache->add(BASE + slot * BLOB_SIZE, BLOB_SIZE, methodOf(slot), true);
+        u64 elapsed = nanotime() - start;
+        total_add += elapsed;
+        max_add = std::max(max_add, elapsed);
+        live[slot] = true;
+        max_slot = std::max((int)max_slot, slot);
+
+        // Some methods are unloaded in the meantime
+        if (i % 3 == 2) {
+            int victim = slots[rand() % (i + 1)];
+            if (live[victim]) {
+                cache->remove(BASE + victim * BLOB_SIZE, methodOf(victim));
+                live[victim] = false;
+            }
+        }
+
+        if (i % 1000 == 999) {
+            freeRetired();
+        }
+    }
+
+    running = false;
+    pthread_join(reader, NULL);
+    freeRetired();
+
+    printf("%d blobs: add avg %.1f ns, max %.1f us; concurrent find avg %.1f ns, max %.1f us\n",
+           count, (double)total_add / count, max_add / 1000.0, (double)total_find / finds, max_find / 1000.0);
+    if (wrong_finds > 0) {
+        printf("FAILED: concurrent find returned a wrong method %ld times\n", wrong_finds);
+        return 1;
+    }
+
+    for (int slot = 0; slot < count; slot++) {
+        jmethodID expected = live[slot] ? methodOf(slot) : NULL;
+        if (cache->find(BASE + slot * BLOB_SIZE) != expected || cache->find(BASE + slot * BLOB_SIZE + BLOB_SIZE - 1) != expected) {
+            printf("FAILED: wrong method found for blob %d\n", slot);
+            return 1;
+        }
+    }
+    if (cache->find(BASE - 1) != NULL || cache->find(BASE + count * BLOB_SIZE) != NULL) {
+        printf("FAILED: method found outside of all blobs\n");
+        return 1;
+    }
+
+    delete cache;
+    printf("codeCacheTest passed\n");
+    return 0;
+}
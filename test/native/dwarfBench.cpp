@@ -0,0 +1,107 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares the frame pointer walker with cstack=dwarf on a stack that crosses
+// a library built with -fomit-frame-pointer. The DWARF walk must see every frame
+// of the library; the FP walk is expected to lose them.
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include "engine.h"
+#include "os.h"
+#include "profiler.h"
+#include "stackWalker.h"
+#include "symbols.h"
+
+
+static const int DEPTH = 20;
+static const int MAX_DEPTH = 128;
+static const int ITERATIONS = 10000;
+
+extern "C" int dwarfBenchRecurse(int depth, void (*leaf)());
+
+struct WalkResult {
+    int depth;
+    int lib_frames;
+    u64 ns_per_walk;
+};
+
+static WalkResult fp_result;
+static WalkResult dwarf_result;
+
+static int countLibFrames(const void** callchain, int depth) {
+    int count = 0;
+    for (int i = 0; i < depth; i++) {
+        NativeCodeCache* lib = Profiler::instance()->findNativeLibrary(callchain[i]);
+        if (lib != NULL && strstr(lib->name(), "libdwarfbench") != NULL) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    Engine engine;
+    CodeCache java_methods;
+    CodeCache runtime_stubs;
+    const void* callchain[MAX_DEPTH];
+
+    u64 start = OS::nanotime();
+    for (int i = 0; i < ITERATIONS; i++) {
+        fp_result.depth = engine.getNativeTrace(ucontext, 0, callchain, MAX_DEPTH, &java_methods, &runtime_stubs);
+    }
+    fp_result.ns_per_walk = (OS::nanotime() - start) / ITERATIONS;
+    fp_result.lib_frames = countLibFrames(callchain, fp_result.depth);
+
+    start = OS::nanotime();
+    for (int i = 0; i < ITERATIONS; i++) {
+        dwarf_result.depth = StackWalker::walkDwarf(ucontext, callchain, MAX_DEPTH, &java_methods, &runtime_stubs);
+    }
+    dwarf_result.ns_per_walk = (OS::nanotime() - start) / ITERATIONS;
+    dwarf_result.lib_frames = countLibFrames(callchain, dwarf_result.depth);
+}
+
+static void leaf() {
+    raise(SIGPROF);
+}
+
+static void printResult(const char* title, const WalkResult& r) {
+    printf("%-6s depth=%3d  library frames=%3d  %6llu ns/walk\n",
+           title, r.depth, r.lib_frames, (unsigned long long)r.ns_per_walk);
+}
+
+int main() {
+    Symbols::enableUnwindTables(NULL, 0);
+    Profiler::instance()->updateSymbols(false);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = signalHandler;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGPROF, &sa, NULL);
+
+    dwarfBenchRecurse(DEPTH, leaf);
+
+    printResult("fp", fp_result);
+    printResult("dwarf", dwarf_result);
+
+    if (dwarf_result.lib_frames < DEPTH + 1) {
+        printf("FAILED: DWARF walk found %d of %d library frames\n", dwarf_result.lib_frames, DEPTH + 1);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Built with -fomit-frame-pointer to model native libraries
+// that do not maintain the frame pointer chain. See dwarfBench.cpp.
+
+extern "C" __attribute__((visibility("default"), noinline))
+int dwarfBenchRecurse(int depth, void (*leaf)()) {
+    // Keeps the frame non-empty and the call out of tail position
+    volatile int frame[4];
+    frame[0] = depth;
+
+    if (depth == 0) {
+        leaf();
+        return frame[0];
+    }
+    return dwarfBenchRecurse(depth - 1, leaf) + frame[0];
+}
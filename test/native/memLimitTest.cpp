@@ -0,0 +1,72 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Once memlimit is exhausted, new stacks go to [evicted],
+// but stacks already stored in any table, including superseded ones, are counted as usual.
+
+#include <stdio.h>
+#include "callTraceStorage.h"
+
+
+static const int DEPTH = 4;
+static const int MAX_TRACES = 1000000;
+
+static void makeTrace(ASGCT_CallFrame* frames, int n) {
+    for (int i = 0; i < DEPTH; i++) {
+        frames[i].bci = i;
+        frames[i].method_id = (jmethodID)(size_t)(n * DEPTH + i + 1);
+    }
+}
+
+int main() {
+    CallTraceStorage storage;
+    storage.setMemLimit(16 * 1024 * 1024);
+    storage.clear();
+
+    ASGCT_CallFrame frames[DEPTH];
+    makeTrace(frames, 0);
+    u32 first_id = storage.put(DEPTH, frames, 1, 0);
+
+    int stored = 1;
+    while (storage.evictedSamples() == 0 && stored < MAX_TRACES) {
+        makeTrace(frames, stored++);
+        storage.put(DEPTH, frames, 1, 0);
+    }
+    printf("memlimit reached after %d traces, %ld KB used\n", stored, (long)(storage.usedMemory() >> 10));
+    if (storage.evictedSamples() == 0) {
+        printf("FAILED: memlimit was not reached\n");
+        return 1;
+    }
+
+    // The first trace lives in the initial table, which has been superseded by growth
+    makeTrace(frames, 0);
+    u32 id = storage.put(DEPTH, frames, 1, 0);
+    if (id != first_id) {
+        printf("FAILED: known trace got id %u instead of %u\n", id, first_id);
+        return 1;
+    }
+
+    u64 evicted = storage.evictedSamples();
+    makeTrace(frames, stored);
+    storage.put(DEPTH, frames, 1, 0);
+    if (storage.evictedSamples() != evicted + 1) {
+        printf("FAILED: new trace was stored beyond memlimit\n");
+        return 1;
+    }
+
+    printf("memLimitTest passed\n");
+    return 0;
+}
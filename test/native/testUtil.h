@@ -0,0 +1,43 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TESTUTIL_H
+#define _TESTUTIL_H
+
+#include <time.h>
+#include "arch.h"
+
+
+static inline u64 nanotime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Deterministic LCG, so that every run generates the same traces
+struct Rng {
+    u64 state;
+
+    Rng(u64 seed) : state(seed * 0x9e3779b97f4a7c15ULL + 1) {
+    }
+
+    u32 next(u32 bound) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (u32)(state >> 33) % bound;
+    }
+};
+
+#endif // _TESTUTIL_H
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2021 Andrei Pangin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Memory footprint and insertion cost of flat vs. trie call trace storage.
+// Also verifies that compact traces are expanded back to the original frames.
+// Usage: trieMemoryBench [traces]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "callTraceStorage.h"
+#include "memoryUsage.h"
+#include "testUtil.h"
+
+
+static const int MAX_DEPTH = 160;
+
+static jmethodID method(u32 n) {
+    return (jmethodID)(0x7f0000100000 + (size_t)n * 0x40);
+}
+
+// Web framework-like stack: a fixed prefix of 60 container frames, one of 256 request handlers,
+// then a random walk over a call graph where every method calls one of 3 others.
+// Frames are stored top first, so the root is the last frame.
+static int frameworkTrace(u32 index, ASGCT_CallFrame* frames) {
+    Rng rng(index);
+    ASGCT_CallFrame stack[MAX_DEPTH];
+    int depth = 0;
+
+    for (int i = 0; i < 60; i++) {
+        stack[depth].bci = 10 + i;
+        stack[depth++].method_id = method(i);
+    }
+
+    u32 m = 1000 + rng.next(256);
+    int handler_depth = 10 + rng.next(40);
+    for (int i = 0; i < handler_depth; i++) {
+        stack[depth].bci = m % 50;
+        stack[depth++].method_id = method(m);
+        m = (m * 31 + 7 + rng.next(3)) % 20000 + 1000;
+    }
+
+    for (int i = 0; i < depth; i++) {
+        frames[i] = stack[depth - 1 - i];
+    }
+    return depth;
+}
+
+// Worst case for the trie: 32 frames without any common prefix
+static int unrelatedTrace(u32 index, ASGCT_CallFrame* frames) {
+    Rng rng(index);
+    for (int i = 0; i < 32; i++) {
+        frames[i].bci = rng.next(100);
+        frames[i].method_id = method(rng.next(1000000));
+    }
+    return 32;
+}
+
+// Prefixes of one deep stack, each with one of 7 variants of the top frame:
+// traces end in the middle of stored runs and branch off at every depth
+static int nestedTrace(u32 index, ASGCT_CallFrame* frames) {
+    int depth = 1 + index % 120;
+    for (int i = 0; i < depth; i++) {
+        frames[depth - 1 - i].bci = i;
+        frames[depth - 1 - i].method_id = method(i);
+    }
+    frames[0].bci = (index / 120) % 7;
+    return depth;
+}
+
+typedef int (*TraceGenerator)(u32 index, ASGCT_CallFrame* frames);
+
+static bool run(const char* corpus, TraceGenerator generator, u32 count, bool trie, u64 chunk_baseline) {
+    CallTraceStorage* storage = new CallTraceStorage();
+    storage->setTrie(trie);
+    storage->clear();
+
+    ASGCT_CallFrame frames[MAX_DEPTH];
+    std::vector<u32> ids(count);
+    u64 total_frames = 0;
+
+    u64 start = nanotime();
+    for (u32 i = 0; i < count; i++) {
+        int num_frames = generator(i, frames);
+        total_frames += num_frames;
+        ids[i] = storage->put(num_frames, frames, 1, 0);
+    }
+    u64 elapsed = nanotime() - start;
+
+    u64 chunks = MemoryUsage::bytes(MEM_TRACE_CHUNKS) - chunk_baseline;
+    printf("%-10s %-5s  traces=%u  avg depth=%.1f  chunks=%6.1f MB  %6.1f bytes/trace  %6.1f ns/put\n",
+           corpus, trie ? "trie" : "flat", count, (double)total_frames / count,
+           chunks / 1048576.0, (double)chunks / count, (double)elapsed / count);
+
+    // Every trace must be rebuilt exactly
+    std::map<u32, CallTrace*> traces;
+    storage->collectTraces(traces);
+    TraceExpander expander;
+    bool ok = true;
+
+    for (u32 i = 0; i < count && ok; i++) {
+        int num_frames = generator(i, frames);
+        CallTrace* trace = expander.expand(traces[ids[i]]);
+        ok = trace->num_frames == num_frames;
+        for (int j = 0; j < num_frames && ok; j++) {
+            ok = trace->frames[j].bci == frames[j].bci && trace->frames[j].method_id == frames[j].method_id;
+        }
+        if (!ok) {
+            printf("FAILED: trace %u does not match after expansion\n", i);
+        }
+    }
+
+    delete storage;
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    u32 count = argc > 1 ? atoi(argv[1]) : 100000;
+
+    // Chunks of the profiler's own storages exist regardless of the benchmark
+    u64 chunk_baseline = MemoryUsage::bytes(MEM_TRACE_CHUNKS);
+
+    bool ok = true;
+    ok &= run("framework", frameworkTrace, count, false, chunk_baseline);
+    ok &= run("framework", frameworkTrace, count, true, chunk_baseline);
+    ok &= run("nested", nestedTrace, count, false, chunk_baseline);
+    ok &= run("nested", nestedTrace, count, true, chunk_baseline);
+    ok &= run("unrelated", unrelatedTrace, count, false, chunk_baseline);
+    ok &= run("unrelated", unrelatedTrace, count, true, chunk_baseline);
+    return ok ? 0 : 1;
+}
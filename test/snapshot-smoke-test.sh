@@ -0,0 +1,44 @@
+#!/bin/bash
+
+set -e  # exit on any failure
+set -x  # print all executed lines
+
+if [ -z "${JAVA_HOME}" ]; then
+  echo "JAVA_HOME is not set"
+  exit 1
+fi
+
+(
+  cd $(dirname $0)
+
+  if [ "Target.class" -ot "Target.java" ]; then
+     ${JAVA_HOME}/bin/javac Target.java
+  fi
+
+  ${JAVA_HOME}/bin/java Target &
+
+  FILENAME=/tmp/java.trace
+  JAVAPID=$!
+
+  sleep 1     # allow the Java runtime to initialize
+  ../profiler.sh start -e itimer $JAVAPID
+  sleep 2
+  ../profiler.sh snapshot -f $FILENAME.1 -o collapsed $JAVAPID
+  sleep 2
+  ../profiler.sh stop -f $FILENAME.2 -o collapsed $JAVAPID
+
+  kill $JAVAPID
+
+  function assert_string() {
+    if ! grep -q "$1" $2; then
+      exit 1
+    fi
+  }
+
+  # Both the snapshot and the profile collected after it contain samples
+  for f in $FILENAME.1 $FILENAME.2; do
+    assert_string "Target.main;Target.method1 " $f
+    assert_string "Target.main;Target.method2 " $f
+    assert_string "Target.main;Target.method3;java/io/File" $f
+  done
+)